@@ -0,0 +1,32 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Copyright 2022 David De Grave <david@ledav.net>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+# the Software, and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+# FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+# COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+# IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+# Throughput of logger_printf() from 1 to <max threads> writers (default: the number of cores).
+# The lines go to /dev/null: it is the cost for the writers, not the one of the terminal, that is measured.
+
+max=${1:-$(nproc)}
+lines=${2:-1000000}
+
+for ((thr = 1; thr <= max; thr *= 2)); do
+	# <threads> <qmin> <qmax> <total> <max/thd> <us wait> <chance 1/n> [non-blocking] [print lost] [noqueue] [prealloc]
+	./logger $thr 4096 4096 $lines $((lines / thr)) 0 1000000000 0 0 0 1 2>&1 >/dev/null | grep "^bench:"
+done
@@ -0,0 +1,298 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2022 David De Grave <david@ledav.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#if defined(LOGGER_USE_THREAD)
+
+#include <sys/uio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(LOGGER_USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "logger.h"
+#include "logger-thread.h"
+
+// Comment this to turn off the debug lines to stderr for this source.
+//#define _DEBUG_LOGGER
+
+#ifdef _DEBUG_LOGGER
+#define dbg_printf(args...) fprintf(stderr, args)
+#else
+#define dbg_printf(...)
+#endif
+
+#if defined(LOGGER_USE_ZLIB)
+
+/**
+ * Compressed output (LOGGER_OPT_GZIP).  The reader copies what it would
+ * have written in chunks, and hands them to the compression thread.  Each
+ * chunk becomes a gzip member of its own: the file is a valid gzip stream,
+ * and it can be read from the start of any member.  A chunk starts with a
+ * write of the reader (so with a line) when it fits, and with
+ * LOGGER_OPT_INDEX the time of this line and the offset of the member go
+ * in the index.  The reader only waits when all the chunks are still to be
+ * compressed.
+ */
+static struct {
+    char		*chunk[LOGGER_GZIP_CHUNKS];	/* Chunks of output */
+    size_t		len[LOGGER_GZIP_CHUNKS];	/* Bytes used in each of them */
+    unsigned long	ms[LOGGER_GZIP_CHUNKS];		/* Time of the line each one starts with (0: in a line) */
+    atomic_int		handed;				/* Chunks given to the compression thread so far */
+    atomic_int		written;			/* Chunks compressed & written so far */
+    atomic_int		kick;				/* Changed to wake up the compression thread */
+    bool		running;			/* Set to false to stop it (once everything is written) */
+    unsigned char	*out;				/* Compressed member */
+    size_t		out_sz;				/* Its size (deflateBound() of a whole chunk) */
+    z_stream		z;				/* Compression state (reset for each member) */
+    pthread_t		thread;				/* Compression thread */
+} _logger_gzip;
+
+static int _logger_gzip_write_all(const unsigned char *p, size_t n)
+{
+    while (n) {
+        ssize_t r = write(1, p, n);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static void *_thread_gzip(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        int kick = atomic_load(&_logger_gzip.kick);
+        int done = atomic_load(&_logger_gzip.written);
+
+        if (done == atomic_load(&_logger_gzip.handed)) {
+            if (!_logger_gzip.running) {
+                break;
+            }
+            futex_wait(&_logger_gzip.kick, kick);
+            continue;
+        }
+        int c = done % LOGGER_GZIP_CHUNKS;
+
+        _logger_gzip.z.next_in = (unsigned char *)_logger_gzip.chunk[c];
+        _logger_gzip.z.avail_in = _logger_gzip.len[c];
+        _logger_gzip.z.next_out = _logger_gzip.out;
+        _logger_gzip.z.avail_out = _logger_gzip.out_sz;
+
+        size_t n = 0;
+
+        if (deflate(&_logger_gzip.z, Z_FINISH) != Z_STREAM_END
+                || _logger_gzip_write_all(_logger_gzip.out, (n = _logger_gzip.out_sz - _logger_gzip.z.avail_out)) < 0) {
+            /* Same as for the lines, what can't be written is lost ... */
+            dbg_printf("<logger-gzip> Member of %zu bytes lost (%m)\n", _logger_gzip.len[c]);
+        } else {
+            _logger_index_member(_logger_gzip.ms[c], n);
+        }
+        deflateReset(&_logger_gzip.z); // Next one independent
+        _logger_gzip.len[c] = 0;
+
+        atomic_store(&_logger_gzip.written, done + 1);
+        futex_wake(&_logger_gzip.written, INT_MAX);
+    }
+    return NULL;
+}
+
+static void _logger_gzip_free(void)
+{
+    deflateEnd(&_logger_gzip.z);
+    for (int c=0; c<LOGGER_GZIP_CHUNKS; c++) {
+        free(_logger_gzip.chunk[c]);
+        _logger_gzip.chunk[c] = NULL;
+    }
+    free(_logger_gzip.out);
+    _logger_gzip.out = NULL;
+}
+
+int _logger_gzip_init(void)
+{
+    memset(&_logger_gzip, 0, sizeof(_logger_gzip));
+
+    if (deflateInit2(&_logger_gzip.z, LOGGER_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return errno = ENOMEM, -1; // (15 + 16: gzip header & trailer)
+    }
+    _logger_gzip.out_sz = deflateBound(&_logger_gzip.z, LOGGER_GZIP_CHUNK_SZ);
+    _logger_gzip.out = malloc(_logger_gzip.out_sz);
+
+    bool allocated = _logger_gzip.out;
+    for (int c=0; c<LOGGER_GZIP_CHUNKS && allocated; c++) {
+        allocated = (_logger_gzip.chunk[c] = malloc(LOGGER_GZIP_CHUNK_SZ));
+    }
+    if (!allocated) {
+        _logger_gzip_free();
+        return errno = ENOMEM, -1;
+    }
+    _logger_gzip.running = true;
+
+    if ((errno = pthread_create(&_logger_gzip.thread, NULL, _thread_gzip, NULL))) {
+        int err = errno;
+
+        _logger_gzip.running = false;
+        _logger_gzip_free();
+        return errno = err, -1;
+    }
+    pthread_setname_np(_logger_gzip.thread, "logger-gzip");
+    return 0;
+}
+
+/* Gives the chunk being filled to the compression thread (even if not full) */
+void _logger_gzip_handoff(void)
+{
+    int handed = atomic_load(&_logger_gzip.handed);
+    int c = handed % LOGGER_GZIP_CHUNKS;
+
+    /* (When they are all on the way, this one is not the chunk being filled) */
+    if (handed - atomic_load(&_logger_gzip.written) < LOGGER_GZIP_CHUNKS && _logger_gzip.len[c]) {
+        atomic_fetch_add(&_logger_gzip.handed, 1);
+        atomic_fetch_add(&_logger_gzip.kick, 1);
+        futex_wake(&_logger_gzip.kick, 1);
+    }
+}
+
+/**
+ * Same as writev(1, ...): copied in the chunks, handed over when full.  ms
+ * is the time of the line the data starts with (0: none).  Kept in a
+ * single chunk when it fits, so the members start with a line.
+ */
+ssize_t _logger_gzip_writev(const struct iovec *iov, int iovcnt, unsigned long ms)
+{
+    size_t size = 0, left, done = 0;
+
+    for (int i=0; i<iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    for (left = size; left; ) {
+        int handed = atomic_load(&_logger_gzip.handed), written;
+
+        while (handed - (written = atomic_load(&_logger_gzip.written)) >= LOGGER_GZIP_CHUNKS) {
+            /* All of them are waiting to be compressed: the disk (or the CPU) can't follow */
+            futex_wait(&_logger_gzip.written, written);
+        }
+        int c = handed % LOGGER_GZIP_CHUNKS;
+        size_t n = LOGGER_GZIP_CHUNK_SZ - _logger_gzip.len[c];
+
+        if (!done && n < size && size <= LOGGER_GZIP_CHUNK_SZ) {
+            _logger_gzip_handoff(); // Doesn't fit in this one, but in the next
+            continue;
+        }
+        if (!_logger_gzip.len[c]) {
+            _logger_gzip.ms[c] = done ? 0 : ms;
+        }
+        if (n > left) {
+            n = left;
+        }
+        for (size_t copied = 0; copied < n; ) {
+            /* Piece of the iovec at `done` */
+            size_t at = done;
+            int i = 0;
+
+            while (at >= iov[i].iov_len) {
+                at -= iov[i++].iov_len;
+            }
+            size_t len = iov[i].iov_len - at < n - copied ? iov[i].iov_len - at : n - copied;
+
+            memcpy(_logger_gzip.chunk[c] + _logger_gzip.len[c], (const char *)iov[i].iov_base + at, len);
+            _logger_gzip.len[c] += len;
+            copied += len;
+            done += len;
+        }
+        left -= n;
+
+        if (_logger_gzip.len[c] == LOGGER_GZIP_CHUNK_SZ) {
+            _logger_gzip_handoff();
+        }
+    }
+    return size;
+}
+
+/* Waits until what was handed over is written (end: CLOCK_MONOTONIC limit, NULL: none) */
+int _logger_gzip_wait(const struct timespec *end)
+{
+    int target = atomic_load(&_logger_gzip.handed), written;
+
+    while ((written = atomic_load(&_logger_gzip.written)) - target < 0) {
+        struct timespec now, left = { 0 }, *ts = NULL;
+
+        if (end) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ns = timespec_to_ns(*end) - timespec_to_ns(now);
+            if (ns <= 0) {
+                return errno = ETIMEDOUT, -1;
+            }
+            left.tv_sec = NTOS(ns);
+            left.tv_nsec = ns % STON(1);
+            ts = &left;
+        }
+        if (futex_timed_wait(&_logger_gzip.written, written, ts) < 0
+                && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Called once the reader is stopped: compresses what's left & stops the thread */
+void _logger_gzip_deinit(void)
+{
+    _logger_gzip_handoff();
+    _logger_gzip.running = false;
+    atomic_fetch_add(&_logger_gzip.kick, 1);
+    futex_wake(&_logger_gzip.kick, 1);
+    pthread_join(_logger_gzip.thread, NULL);
+    _logger_gzip_free();
+}
+
+#else // !LOGGER_USE_ZLIB
+
+int _logger_gzip_init(void)
+{
+    return errno = ENOTSUP, -1; // Not built with zlib
+}
+
+void _logger_gzip_handoff(void) {}
+ssize_t _logger_gzip_writev(const struct iovec *iov, int iovcnt, unsigned long ms) { return errno = ENOTSUP, -1; }
+int _logger_gzip_wait(const struct timespec *end) { return 0; }
+void _logger_gzip_deinit(void) {}
+
+#endif // defined(LOGGER_USE_ZLIB)
+#endif // defined(LOGGER_USE_THREAD)
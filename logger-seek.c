@@ -0,0 +1,517 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2022 David De Grave <david@ledav.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * logger-seek: prints the lines of a time range of a log file written with
+ * LOGGER_OPT_INDEX, optionally filtered by level and thread.
+ *
+ * The index ("<file>.idx") gives where to start and where to stop: only
+ * this part of the file is read (mapped) and the time stamp of each of its
+ * lines is checked, to the millisecond.  Without index, the whole file is
+ * scanned.  Text, JSON and logfmt lines are understood.  A gzipped file
+ * (LOGGER_OPT_GZIP) is indexed by member: only the members of the range are
+ * decompressed (built with LOGGER_USE_ZLIB).
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+
+#if defined(LOGGER_USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "logger.h"
+
+/* Same as logger-thread.c: labels of the text lines, names of the structured ones */
+static const char * const _seek_level_label[LOGGER_LEVEL_COUNT] = {
+    [LOGGER_LEVEL_EMERG]    = "EMERG",
+    [LOGGER_LEVEL_ALERT]    = "ALERT",
+    [LOGGER_LEVEL_CRITICAL] = "CRIT!",
+    [LOGGER_LEVEL_ERROR]    = "ERROR",
+    [LOGGER_LEVEL_WARNING]  = "WARN!",
+    [LOGGER_LEVEL_NOTICE]   = "NOTCE",
+    [LOGGER_LEVEL_INFO]     = "INFO ",
+    [LOGGER_LEVEL_DEBUG]    = "DEBUG",
+    [LOGGER_LEVEL_OKAY]     = "OKAY ",
+    [LOGGER_LEVEL_TRACE]    = "TRACE",
+    [LOGGER_LEVEL_OOPS]     = "OOPS!",
+};
+
+static const char * const _seek_level_name[LOGGER_LEVEL_COUNT] = {
+    [LOGGER_LEVEL_EMERG]    = "emerg",
+    [LOGGER_LEVEL_ALERT]    = "alert",
+    [LOGGER_LEVEL_CRITICAL] = "crit",
+    [LOGGER_LEVEL_ERROR]    = "error",
+    [LOGGER_LEVEL_WARNING]  = "warning",
+    [LOGGER_LEVEL_NOTICE]   = "notice",
+    [LOGGER_LEVEL_INFO]     = "info",
+    [LOGGER_LEVEL_DEBUG]    = "debug",
+    [LOGGER_LEVEL_OKAY]     = "okay",
+    [LOGGER_LEVEL_TRACE]    = "trace",
+    [LOGGER_LEVEL_OOPS]     = "oops",
+};
+
+/* What is known of a line of the file */
+typedef struct {
+    long	ms;			/* Time stamp (ms since the epoch), -1: not a log line */
+    int		level;			/* -1 if unknown */
+    char	thread[2 * LOGGER_MAX_THREAD_NAME_SZ]; /* "thread" or "thread/task" */
+    bool	date;			/* Date line of the text format ("-- YYYY-MM-DD --") */
+} _seek_line_t;
+
+/* Local day of the text lines (they only have the time) and the start of their hour */
+static struct {
+    struct tm	day;
+    int		hour;			/* Hour of hour_ms, -1: to compute */
+    long	hour_ms;
+} _seek_day;
+
+static void _seek_set_day(long ms)
+{
+    time_t sec = ms / 1000;
+
+    localtime_r(&sec, &_seek_day.day);
+    _seek_day.hour = -1;
+}
+
+/* Local "HH:MM:SS.mmm" of the current day, in ms since the epoch */
+static long _seek_local_ms(int h, int m, int s, int ms)
+{
+    if (h != _seek_day.hour) {
+        struct tm tm = _seek_day.day;
+
+        tm.tm_hour = h;
+        tm.tm_min = tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        _seek_day.hour_ms = mktime(&tm) * 1000L;
+        _seek_day.hour = h;
+    }
+    return _seek_day.hour_ms + (m * 60 + s) * 1000L + ms;
+}
+
+/* Copies the start of a text line without its colors */
+static size_t _seek_strip(const char *p, const char *end, char *out, size_t size)
+{
+    size_t len = 0;
+
+    while (p < end && *p != '\n' && len < size - 1) {
+        if (*p == '\033') {
+            while (p < end && *p != 'm' && *p != '\n') {
+                p++;
+            }
+            p += p < end && *p == 'm';
+            continue;
+        }
+        out[len++] = *p++;
+    }
+    out[len] = 0;
+    return len;
+}
+
+/* Value of "key" in a JSON line ("key":"value") or a logfmt one (key=value or key="value") */
+static int _seek_field(const char *s, const char *key, char *out, size_t size)
+{
+    char k[32];
+    const char *v;
+    size_t len = 0;
+
+    snprintf(k, sizeof(k), *s == '{' ? "\"%s\":\"" : " %s=", key);
+    if (!(v = strstr(s, k))) {
+        return -1;
+    }
+    v += strlen(k);
+    char stop = *s == '{' ? '"' : ' ';
+    if (*s != '{' && *v == '"') {
+        stop = '"';
+        v++;
+    }
+    while (v[len] && v[len] != stop && len < size - 1) {
+        out[len] = v[len];
+        len++;
+    }
+    out[len] = 0;
+    return len;
+}
+
+static int _seek_level(const char *name, const char * const *names, size_t n)
+{
+    for (int i=0; i<LOGGER_LEVEL_COUNT; i++) {
+        if (!strncasecmp(name, names[i], n) && (n == 5 || !names[i][n])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void _seek_parse(const char *p, const char *end, _seek_line_t *line)
+{
+    char s[LOGGER_MAX_PREFIX_SZ + 2 * LOGGER_MAX_THREAD_NAME_SZ], tmp[32];
+    int y, mo, d, h, m, sec, ms, us;
+
+    line->ms = -1;
+    line->level = -1;
+    line->thread[0] = 0;
+    line->date = false;
+
+    if (*p == '{' || !strncmp(p, "ts=", 3)) {
+        /* JSON / logfmt: {"ts":"2022-10-18T10:05:08.758816Z",... or ts=2022-10-18T10:05:08.758816Z ... */
+        size_t len = end - p < sizeof(s) - 1 ? end - p : sizeof(s) - 1;
+        struct tm tm = { 0 };
+
+        memcpy(s, p, len);
+        s[len] = 0;
+        if (sscanf(s + (*p == '{' ? 7 : 3), "%4d-%2d-%2dT%2d:%2d:%2d.%6dZ", &y, &mo, &d, &h, &m, &sec, &us) != 7) {
+            return;
+        }
+        tm.tm_year = y - 1900;
+        tm.tm_mon = mo - 1;
+        tm.tm_mday = d;
+        tm.tm_hour = h;
+        tm.tm_min = m;
+        tm.tm_sec = sec;
+        line->ms = timegm(&tm) * 1000L + us / 1000;
+        if (_seek_field(s, "level", tmp, sizeof(tmp)) > 0) {
+            line->level = _seek_level(tmp, _seek_level_name, strlen(tmp));
+        }
+        _seek_field(s, "thread", line->thread, sizeof(line->thread));
+        if (_seek_field(s, "task", tmp, sizeof(tmp)) > 0) {
+            snprintf(line->thread + strlen(line->thread), sizeof(line->thread) - strlen(line->thread), "/%s", tmp);
+        }
+        return;
+    }
+    _seek_strip(p, end, s, sizeof(s));
+
+    if (sscanf(s, "-- %4d-%2d-%2d --", &y, &mo, &d) == 3) {
+        _seek_day.day = (struct tm){ .tm_year = y - 1900, .tm_mon = mo - 1, .tm_mday = d };
+        _seek_day.hour = -1;
+        line->date = true;
+        return;
+    }
+    /* "HH:MM:SS.mmm,uuu [LABEL] <source> <thread> message" */
+    if (sscanf(s, "%2d:%2d:%2d.%3d", &h, &m, &sec, &ms) != 4 || s[2] != ':') {
+        return;
+    }
+    line->ms = _seek_local_ms(h, m, sec, ms);
+
+    char *label = strchr(s, '[');
+    if (!label) {
+        return;
+    }
+    line->level = _seek_level(label + 1, _seek_level_label, 5);
+
+    /* The source has a fixed width: the thread name is right after it */
+    char *name = label + 1 + 5 + 2 + LOGGER_MAX_SOURCE_LEN + 1;
+    if (name - s < strlen(s) && *name == '<') {
+        size_t len = 0;
+
+        while (*++name == ' ');
+        while (name[len] && name[len] != '>' && len < sizeof(line->thread) - 1) {
+            line->thread[len] = name[len];
+            len++;
+        }
+        line->thread[len] = 0;
+    }
+}
+
+static bool _seek_thread_match(const char *thread, const char *want)
+{
+    size_t n = strlen(want);
+
+    /* "thread" matches its tasks too ("thread/task") */
+    return !strncmp(thread, want, n) && (!thread[n] || thread[n] == '/');
+}
+
+/* ms since the epoch, "[YYYY-MM-DD ]HH:MM[:SS[.mmm]]" (local time, on the day of ref_ms by default) */
+static long _seek_parse_time(const char *arg, long ref_ms)
+{
+    struct tm tm;
+    time_t ref = ref_ms / 1000;
+    int y, mo, d, h, m, s = 0, ms = 0, n = 0;
+    char *end;
+
+    long v = strtol(arg, &end, 10);
+    if (!*end) {
+        return v;
+    }
+    localtime_r(&ref, &tm);
+    if (sscanf(arg, "%4d-%2d-%2d%*[ T]%n", &y, &mo, &d, &n) == 3 && n) {
+        if (mo < 1 || mo > 12 || d < 1 || d > 31) {
+            return -1;
+        }
+        tm.tm_year = y - 1900;
+        tm.tm_mon = mo - 1;
+        tm.tm_mday = d;
+        arg += n;
+    }
+    n = 0;
+    if (sscanf(arg, "%2d:%2d%n:%2d%n", &h, &m, &n, &s, &n) < 2
+            || h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 60) {
+        return -1; // (60: leap second)
+    }
+    if (arg[n] == '.') {
+        /* Fraction of second: ".5" is 500 ms */
+        for (int i=1, scale=100; i<=3 && isdigit(arg[n+i]); i++, scale/=10) {
+            ms += (arg[n+i] - '0') * scale;
+        }
+    }
+    tm.tm_hour = h;
+    tm.tm_min = m;
+    tm.tm_sec = s;
+    tm.tm_isdst = -1;
+    return mktime(&tm) * 1000L + ms;
+}
+
+static void *_seek_map(const char *path, size_t *size)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    void *p = NULL;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        p = p == MAP_FAILED ? NULL : p;
+        *size = st.st_size;
+    }
+    close(fd);
+    return p;
+}
+
+/* What is printed, and where the scan is */
+static struct {
+    long	from, to;
+    int		level_max;
+    const char	*thread;
+    const char	*date;			/* Date line to print before the next line printed */
+    size_t	date_len;
+    bool	print;			/* The last line is printed (so its continuation lines too) */
+} _seek;
+
+/* Prints the lines of [p, end) in the range.  Returns where the last (incomplete) line starts */
+static const char *_seek_scan(const char *p, const char *end, bool last)
+{
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
+        _seek_line_t line;
+
+        if (!eol && !last) {
+            break; // The rest is in the next part
+        }
+        _seek_parse(p, next, &line);
+        if (line.date) {
+            _seek.date = p; // Printed with the 1st line of its day
+            _seek.date_len = next - p;
+            _seek.print = false;
+        } else if (line.ms >= 0) {
+            _seek.print = line.ms >= _seek.from && line.ms <= _seek.to
+                          && (line.level < 0 || line.level <= _seek.level_max)
+                          && (!_seek.thread || _seek_thread_match(line.thread, _seek.thread));
+        } // else: continuation of the line before (attachment, ...)
+
+        if (_seek.print) {
+            if (_seek.date) {
+                fwrite(_seek.date, 1, _seek.date_len, stdout);
+                _seek.date = NULL;
+            }
+            fwrite(p, 1, next - p, stdout);
+        }
+        p = next;
+    }
+    return p;
+}
+
+#if defined(LOGGER_USE_ZLIB)
+/* Decompresses the members of [p, end) by parts, scanned as they come */
+static int _seek_gunzip(const char *p, const char *end)
+{
+    static char buf[4 * 1024 * 1024];
+    static char date[LOGGER_LINE_SZ];
+    z_stream z = { .next_in = (unsigned char *)p, .avail_in = end - p };
+    size_t len = 0;
+    int r = Z_OK;
+
+    if (inflateInit2(&z, 15 + 16) != Z_OK) {
+        return -1;
+    }
+    while (r != Z_STREAM_END || z.avail_in) {
+        if (r == Z_STREAM_END) {
+            inflateReset(&z); // Next member
+        }
+        z.next_out = (unsigned char *)buf + len;
+        z.avail_out = sizeof(buf) - len;
+        r = inflate(&z, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END) {
+            break; // Truncated (still being written, crash, ...) or corrupted: what we have is printed
+        }
+        len = sizeof(buf) - z.avail_out;
+
+        const char *rest = _seek_scan(buf, buf + len, false);
+        if (rest == buf && len == sizeof(buf)) {
+            rest = _seek_scan(buf, buf + len, true); // A line longer than the buffer, cut
+        }
+        if (_seek.date && _seek.date != date) {
+            /* Pointing in the buffer, about to be reused */
+            _seek.date_len = _seek.date_len < sizeof(date) ? _seek.date_len : sizeof(date);
+            memcpy(date, _seek.date, _seek.date_len);
+            _seek.date = date;
+        }
+        len = buf + len - rest;
+        memmove(buf, rest, len);
+    }
+    _seek_scan(buf, buf + len, true);
+    inflateEnd(&z);
+    return r == Z_STREAM_END ? 0 : -1;
+}
+#endif
+
+static void _seek_usage(const char *prog)
+{
+    fprintf(stderr, "%s [-f from] [-t to] [-l level] [-T thread] file\n"
+                    "  from, to: ms since the epoch or \"[YYYY-MM-DD ]HH:MM[:SS[.mmm]]\" (local time,\n"
+                    "            on the day of the last line indexed by default). Both included.\n"
+                    "  level:    least important level printed (emerg, alert, crit, error, warning,\n"
+                    "            notice, info, debug, okay, trace, oops) or its number\n"
+                    "  thread:   name of the thread (its tasks included)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *from_arg = NULL, *to_arg = NULL;
+    int opt;
+
+    _seek.level_max = LOGGER_LEVEL_LAST;
+    while ((opt = getopt(argc, argv, "f:t:l:T:h")) != -1) {
+        switch (opt) {
+        case 'f': from_arg = optarg; break;
+        case 't': to_arg = optarg; break;
+        case 'T': _seek.thread = optarg; break;
+        case 'l':
+            _seek.level_max = isdigit(*optarg) ? atoi(optarg) : _seek_level(optarg, _seek_level_name, strlen(optarg));
+            if (_seek.level_max < 0) {
+                fprintf(stderr, "Unknown level: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            _seek_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        _seek_usage(argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+    size_t size = 0, idx_size = 0;
+    const char *data = _seek_map(path, &size);
+
+    if (!data) {
+        if (size) {
+            perror(path);
+            return 1;
+        }
+        return 0; // Empty
+    }
+    char idx_path[PATH_MAX];
+    snprintf(idx_path, sizeof(idx_path), "%s%s", path, LOGGER_INDEX_SUFFIX);
+
+    const logger_index_entry_t *idx = _seek_map(idx_path, &idx_size);
+    size_t idx_nr = idx ? idx_size / sizeof(*idx) : 0;
+    if (!idx) {
+        fprintf(stderr, "%s: no index, the whole file is scanned\n", idx_path);
+    }
+
+    long ref_ms = idx_nr ? (long)idx[idx_nr-1].ms : time(NULL) * 1000L;
+    long from = _seek.from = from_arg ? _seek_parse_time(from_arg, ref_ms) : 0;
+    long to = _seek.to = to_arg ? _seek_parse_time(to_arg, ref_ms) : LONG_MAX;
+    if (from < 0 || to < 0) {
+        fprintf(stderr, "Bad time: %s\n", from < 0 ? from_arg : to_arg);
+        return 1;
+    }
+    bool gzipped = size >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b;
+
+    /**
+     * Start at the last entry before `from` and stop at the 1st one after
+     * `to`.  One entry more each side: a line late of a few ms (see
+     * LOGGER_ORDER_HOLD_US) can be written after newer ones.  Gzipped, the
+     * entries are the members starting with a line: the same works.
+     */
+    size_t start = 0, stop = size, lo = 0, hi = idx_nr;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        (long)idx[mid].ms < from ? (lo = mid + 1) : (hi = mid);
+    }
+    _seek_set_day(ref_ms); // Until a date line says otherwise (the 1st line of a new file is one)
+    if (lo >= 2) {
+        start = idx[lo-2].offset;
+        _seek_set_day(idx[lo-2].ms);
+    }
+    for (size_t i=lo; i<idx_nr; i++) {
+        if ((long)idx[i].ms > to) {
+            if (i + 1 < idx_nr && idx[i+1].offset < size) {
+                stop = idx[i+1].offset;
+            }
+            break;
+        }
+    }
+    if (start > size) {
+        start = size; // Entries of lines that were not written (crash, disk full, ...)
+    }
+    while (!gzipped && start > 0 && start < size && data[start-1] != '\n') {
+        start++; // Not the start of a line (somebody else wrote in the file). Take the next one
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    static char out[1024 * 1024];
+    int ret = 0;
+
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+    if (!gzipped) {
+        _seek_scan(data + start, data + stop, true);
+    } else {
+#if defined(LOGGER_USE_ZLIB)
+        if (_seek_gunzip(data + start, data + stop) < 0) {
+            fprintf(stderr, "%s: truncated or corrupted gzip data\n", path);
+            ret = 1;
+        }
+#else
+        fprintf(stderr, "%s: gzipped, and not built with LOGGER_USE_ZLIB\n", path);
+        ret = 1;
+#endif
+    }
+    fflush(stdout);
+    return ret;
+}
@@ -23,10 +23,23 @@
 
 #if defined(LOGGER_USE_THREAD)
 
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -59,11 +72,51 @@ static const char * const _logger_level_label[LOGGER_LEVEL_COUNT] = {
     [LOGGER_LEVEL_OOPS]     = "OOPS!",
 };
 
+/* Level names for the structured formats (JSON / logfmt) */
+static const char * const _logger_level_name[LOGGER_LEVEL_COUNT] = {
+    [LOGGER_LEVEL_EMERG]    = "emerg",
+    [LOGGER_LEVEL_ALERT]    = "alert",
+    [LOGGER_LEVEL_CRITICAL] = "crit",
+    [LOGGER_LEVEL_ERROR]    = "error",
+    [LOGGER_LEVEL_WARNING]  = "warning",
+    [LOGGER_LEVEL_NOTICE]   = "notice",
+    [LOGGER_LEVEL_INFO]     = "info",
+    [LOGGER_LEVEL_DEBUG]    = "debug",
+    [LOGGER_LEVEL_OKAY]     = "okay",
+    [LOGGER_LEVEL_TRACE]    = "trace",
+    [LOGGER_LEVEL_OOPS]     = "oops",
+};
+
+/* Biggest formatted line. The escaping of the structured formats can make it longer than the line itself */
+#define _LOGGER_OUTPUT_LINE_SZ	(2 * LOGGER_LINE_SZ + LOGGER_MAX_PREFIX_SZ)
+
+/* Widest name printed: "thread/task" (the task is cut, see _logger_format_text()) */
+#define _LOGGER_NAME_WIDTH_MAX	(2 * LOGGER_MAX_THREAD_NAME_SZ - 1)
+
+/* Lines prefetched ahead when taking a run of lines of the same queue */
+#define _LOGGER_RUN_PREFETCH	2
+
 typedef struct {
-    unsigned long         ts;  /* Key to sort on (ts of current line) */
-    logger_write_queue_t *wrq; /* Related write queue */
+    unsigned long         ts;   /* Key to sort on (ts of current line) */
+    logger_write_queue_t *wrq;  /* Related write queue */
+    logger_line_t        *line; /* Current line (in the queue or in its overflow) */
 } _logger_fuse_entry_t;
 
+/* State of a merge, kept between the steps (run by the reader thread, logger_process() or a group thread) */
+typedef struct {
+    _logger_fuse_entry_t *fuse;		/* Merge table: 1 entry per queue (logger.queues_max) */
+    size_t		fuse_sz;	/* Its mapped size */
+    int			fuse_nr;	/* Entries in use (0: to be (re)loaded) */
+    int			empty_nr;	/* Empty queues (at the end of the table) */
+    unsigned long	safe_ts;	/* Lines up to this time stamp are known to be in order */
+    unsigned long	hold_since;	/* Waiting for a late line since ... */
+    bool		printed;	/* The 1st line of the table was printed (to be freed) */
+    bool		unordered;	/* Mode of the table */
+    int			reload;		/* logger.reload when the table was loaded */
+    logger_group_t	*group;		/* Group merged (its lines go in its queue), NULL: the reader (printed) */
+    pthread_mutex_t	mx;		/* Only one logger_process() at a time */
+} _logger_reader_t;
+
 static const char *_logger_get_date(unsigned long sec, const logger_line_colors_t *c)
 {
     static char date[64];
@@ -83,26 +136,585 @@ static const char *_logger_get_date(unsigned long sec, const logger_line_colors_
     return "";
 }
 
-static const char *_logger_get_time(unsigned long sec, const logger_line_colors_t *c)
+/* "HH:MM" of the last minute seen. One for the reader, one per writer (LOGGER_OPT_PRERENDER) */
+typedef struct {
+    char			str[32];
+    unsigned long		min;
+    const logger_line_colors_t	*theme;
+} _logger_time_t;
+
+static const char *_logger_get_time(_logger_time_t *t, unsigned long sec, const logger_line_colors_t *c)
 {
-    static char time[32];
-    static unsigned long prev_min = 0;
     unsigned long min = sec / 60;
 
-    if (min != prev_min) {
+    if (min != t->min || c != t->theme) {
         char tmp[8];
         struct tm tm;
         localtime_r((const time_t *)&sec, &tm);
         strftime(tmp, sizeof(tmp), "%H:%M", &tm);
-        sprintf(time, "%s%s%s", c->time, tmp, c->reset);
-        prev_min = min;
+        sprintf(t->str, "%s%s%s", c->time, tmp, c->reset);
+        t->min = min;
+        t->theme = c;
+    }
+    return t->str;
+}
+
+static struct {
+    char		*buf;			/* Lines formatted but not yet written */
+    size_t		size;			/* Size of buf */
+    size_t		len;			/* Bytes used in buf */
+    char		static_buf[LOGGER_OUTPUT_BUF_SZ];
+
+    /* LOGGER_OPT_SPLICE: buf is a slot of the ring, given to the pipe with vmsplice() */
+    char		*ring;			/* slots_nr * LOGGER_OUTPUT_BUF_SZ, page aligned */
+    unsigned long	*ends;			/* Bytes given to the pipe when each slot was left */
+    size_t		slots_nr;
+    size_t		slot;			/* Slot used by buf */
+    size_t		spliced;		/* Bytes of buf already given (not to be touched anymore) */
+    size_t		page_sz;
+    unsigned long	total;			/* Bytes given to the pipe so far */
+} _logger_output = {
+    .buf  = _logger_output.static_buf,
+    .size = LOGGER_OUTPUT_BUF_SZ,
+};
+
+/* Waits until the reader of the pipe read everything that was given before `end` */
+static void _logger_splice_wait(unsigned long end)
+{
+    int unread;
+
+    /* The bytes of the others writing in the pipe are counted too: at worst we wait a bit more */
+    while (ioctl(1, FIONREAD, &unread) == 0 && _logger_output.total - unread < end) {
+        usleep(50);
+    }
+}
+
+/* The whole pages are spliced (a pipe buffer each), the last partial one is copied with write() */
+static int _logger_splice_flush(void)
+{
+    size_t pages = _logger_output.len & ~(_logger_output.page_sz - 1);
+    int ret = _logger_output.len - _logger_output.spliced;
+
+    while (_logger_output.spliced < pages) {
+        struct iovec v = { _logger_output.buf + _logger_output.spliced, pages - _logger_output.spliced };
+        ssize_t r = vmsplice(1, &v, 1, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        _logger_output.spliced += r;
+        _logger_output.total += r;
+    }
+    while (ret >= 0 && _logger_output.spliced < _logger_output.len) {
+        ssize_t r = write(1, _logger_output.buf + _logger_output.spliced, _logger_output.len - _logger_output.spliced);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        _logger_output.spliced += r;
+        _logger_output.total += r;
+    }
+    _logger_output.len = _logger_output.spliced; // What can't be written is lost ...
+
+    if (_logger_output.size - _logger_output.len < _LOGGER_OUTPUT_LINE_SZ) {
+        /* Next slot, once the pipe doesn't refer to its pages anymore */
+        _logger_output.ends[_logger_output.slot] = _logger_output.total;
+        _logger_output.slot = (_logger_output.slot + 1) % _logger_output.slots_nr;
+        _logger_splice_wait(_logger_output.ends[_logger_output.slot]);
+        _logger_output.buf = _logger_output.ring + _logger_output.slot * LOGGER_OUTPUT_BUF_SZ;
+        _logger_output.len = _logger_output.spliced = 0;
+    }
+    return ret;
+}
+
+int _logger_splice_init(void)
+{
+    struct stat st;
+
+    if (fstat(1, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        logger.opts &= ~LOGGER_OPT_SPLICE; // Not a pipe: written as usual
+        return 0;
+    }
+    /* Fails above /proc/sys/fs/pipe-max-size without CAP_SYS_RESOURCE: the current size is kept */
+    if (fcntl(1, F_GETPIPE_SZ) < LOGGER_PIPE_SZ) {
+        fcntl(1, F_SETPIPE_SZ, LOGGER_PIPE_SZ);
+    }
+    int pipe_sz = fcntl(1, F_GETPIPE_SZ);
+    if (pipe_sz < 0) {
+        return -1;
+    }
+    /* The pipe can't hold more than pipe_sz bytes: the slot we come back to was read, normally */
+    size_t slots_nr = pipe_sz / (LOGGER_OUTPUT_BUF_SZ - _LOGGER_OUTPUT_LINE_SZ) + 2;
+    char *ring = mmap(NULL, slots_nr * LOGGER_OUTPUT_BUF_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return -1;
+    }
+    if (!(_logger_output.ends = calloc(slots_nr, sizeof(unsigned long)))) {
+        munmap(ring, slots_nr * LOGGER_OUTPUT_BUF_SZ);
+        return -1;
+    }
+    _logger_output.ring = _logger_output.buf = ring;
+    _logger_output.size = LOGGER_OUTPUT_BUF_SZ;
+    _logger_output.slots_nr = slots_nr;
+    _logger_output.slot = _logger_output.spliced = _logger_output.len = 0;
+    _logger_output.page_sz = sysconf(_SC_PAGESIZE);
+    _logger_output.total = 0;
+    dbg_printf("Output spliced in a pipe of %d bytes (%zu slots)\n", pipe_sz, slots_nr);
+    return 0;
+}
+
+void _logger_splice_deinit(void)
+{
+    if (!_logger_output.ring) {
+        return;
+    }
+    /* The pipe keeps a reference on the pages still in it: unmapping them doesn't change their content */
+    munmap(_logger_output.ring, _logger_output.slots_nr * LOGGER_OUTPUT_BUF_SZ);
+    free(_logger_output.ends);
+    _logger_output.ring = NULL;
+    _logger_output.ends = NULL;
+    _logger_output.buf = _logger_output.static_buf;
+    _logger_output.size = LOGGER_OUTPUT_BUF_SZ;
+    _logger_output.len = 0;
+}
+
+/**
+ * LOGGER_OPT_INDEX: (time, offset) entries of the output file, written
+ * after the lines they point to.  Gzipped, an entry per member (written by
+ * the compression thread, see _logger_index_member()).
+ */
+static struct {
+    int			fd;			/* Index file, -1: the output is not indexed */
+    unsigned long	offset;			/* Offset of _logger_output.buf in the output file (gzip: of the next member) */
+    unsigned long	buf_ms;			/* Gzip: time of the 1st line of _logger_output.buf */
+    unsigned long	next;			/* Offset of the next entry, at the latest */
+    int			lines;			/* Lines since the last entry */
+    int			pending_nr;		/* Entries of the lines not yet written */
+    logger_index_entry_t pending[4];
+} _logger_index = { .fd = -1 };
+
+int _logger_index_init(void)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (fstat(1, &st) < 0 || !S_ISREG(st.st_mode)) {
+        logger.opts &= ~LOGGER_OPT_INDEX; // Not a file: nothing to seek in
+        return 0;
+    }
+    if (logger.unordered) {
+        logger.opts &= ~LOGGER_OPT_INDEX; // Not in time order: a search would miss lines
+        return 0;
+    }
+    ssize_t len = readlink("/proc/self/fd/1", path, sizeof(path) - sizeof(LOGGER_INDEX_SUFFIX));
+    if (len < 0) {
+        return -1;
+    }
+    strcpy(path + len, LOGGER_INDEX_SUFFIX);
+
+    off_t offset = fcntl(1, F_GETFL) & O_APPEND ? st.st_size : lseek(1, 0, SEEK_CUR);
+    if (offset < 0) {
+        return -1;
+    }
+    /* A new (or truncated) output starts a new index, otherwise it continues the one there */
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (offset ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    _logger_index.fd = fd;
+    _logger_index.offset = offset;
+    _logger_index.next = offset; // The 1st line has its entry
+    _logger_index.lines = 0;
+    _logger_index.pending_nr = 0;
+    dbg_printf("Output indexed in %s from offset %ld\n", path, (long)offset);
+    return 0;
+}
+
+void _logger_index_deinit(void)
+{
+    if (_logger_index.fd >= 0) {
+        close(_logger_index.fd);
+        _logger_index.fd = -1;
+    }
+}
+
+/* Gzip: a member of size bytes was written.  ms: time of the line it starts with (0: starts in a line) */
+void _logger_index_member(unsigned long ms, size_t size)
+{
+    if (_logger_index.fd < 0) {
+        return;
+    }
+    if (ms) {
+        logger_index_entry_t e = { .ms = ms, .offset = _logger_index.offset };
+
+        if (write(_logger_index.fd, &e, sizeof(e)) < 0) {
+            dbg_printf("<logger-gzip> Index write(): %m\n");
+        }
+    }
+    _logger_index.offset += size;
+}
+
+/* n bytes of the output buffer were written: the entries of its lines can follow */
+static void _logger_index_written(size_t n)
+{
+    _logger_index.offset += n;
+
+    if (_logger_index.pending_nr) {
+        if (write(_logger_index.fd, _logger_index.pending, _logger_index.pending_nr * sizeof(logger_index_entry_t)) < 0) {
+            dbg_printf("<logger-thd-read> Index write(): %m\n");
+        }
+        _logger_index.pending_nr = 0;
+    }
+}
+
+static ssize_t _logger_output_flush(void)
+{
+    size_t done = 0;
+
+    if (_logger_output.ring) {
+        return _logger_splice_flush();
+    }
+    if (logger.opts & LOGGER_OPT_GZIP) {
+        struct iovec iov = { _logger_output.buf, _logger_output.len };
+        ssize_t r = _logger_gzip_writev(&iov, 1, _logger_index.buf_ms);
+
+        _logger_output.len = 0;
+        return r;
+    }
+    while (done < _logger_output.len) {
+        ssize_t r = write(1, _logger_output.buf + done, _logger_output.len - done);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Same as for the lines, what can't be written is lost ... */
+            _logger_output.len = 0;
+            if (_logger_index.fd >= 0) {
+                _logger_index_written(done);
+            }
+            return -1;
+        }
+        done += r;
+    }
+    _logger_output.len = 0;
+    if (_logger_index.fd >= 0) {
+        _logger_index_written(done);
+    }
+    return done;
+}
+
+/* Adds an entry for l (about to be formatted) every LOGGER_INDEX_LINES lines or LOGGER_INDEX_BYTES bytes */
+static inline void _logger_index_line(const logger_line_t *l)
+{
+    unsigned long offset = _logger_index.offset + _logger_output.len;
+
+    if (++_logger_index.lines < LOGGER_INDEX_LINES && offset < _logger_index.next) {
+        return;
+    }
+    if (_logger_index.pending_nr == sizeof(_logger_index.pending) / sizeof(*_logger_index.pending)) {
+        _logger_output_flush(); // Writes them, after their lines
+        offset = _logger_index.offset;
+    }
+    _logger_index.pending[_logger_index.pending_nr++] = (logger_index_entry_t){
+        .ms = l->ts.tv_sec * 1000UL + NTOM(l->ts.tv_nsec),
+        .offset = offset,
+    };
+    _logger_index.lines = 0;
+    _logger_index.next = offset + LOGGER_INDEX_BYTES;
+}
+
+/* Output of the structured formats. Never goes further than end (the '\n' is written after it) */
+typedef struct {
+    char *p;
+    char *end;
+} _logger_out_t;
+
+static inline void _logger_out_put(_logger_out_t *o, const char *s, size_t n)
+{
+    if (n > o->end - o->p) {
+        n = o->end - o->p;
+    }
+    memcpy(o->p, s, n);
+    o->p += n;
+}
+
+static inline void _logger_out_char(_logger_out_t *o, char c)
+{
+    if (o->p < o->end) {
+        *o->p++ = c;
+    }
+}
+
+static void _logger_out_uint(_logger_out_t *o, unsigned long long v)
+{
+    char tmp[24], *p = tmp + sizeof(tmp);
+
+    do { *--p = '0' + v % 10; v /= 10; } while (v);
+    _logger_out_put(o, p, tmp + sizeof(tmp) - p);
+}
+
+static void _logger_out_int(_logger_out_t *o, long long v)
+{
+    if (v < 0) {
+        _logger_out_char(o, '-');
+        _logger_out_uint(o, -(unsigned long long)v);
+    } else {
+        _logger_out_uint(o, v);
+    }
+}
+
+static const char _logger_hex[] = "0123456789abcdef";
+
+/* Escapes n chars (NUL included) for a JSON string. Returns how many fitted */
+static size_t _logger_out_json_chars(_logger_out_t *o, const char *s, size_t n)
+{
+    const char *hex = _logger_hex;
+    size_t i;
+
+    /* Stop early enough to always close the string */
+    for (i = 0; i < n && o->end - o->p > 7; i++) {
+        unsigned char c = s[i];
+
+        if (c == '"' || c == '\\') {
+            *o->p++ = '\\';
+            *o->p++ = c;
+        } else if (c == '\n') {
+            *o->p++ = '\\'; *o->p++ = 'n';
+        } else if (c == '\t') {
+            *o->p++ = '\\'; *o->p++ = 't';
+        } else if (c == '\r') {
+            *o->p++ = '\\'; *o->p++ = 'r';
+        } else if (c < 0x20) {
+            memcpy(o->p, "\\u00", 4);
+            o->p[4] = hex[c >> 4];
+            o->p[5] = hex[c & 15];
+            o->p += 6;
+        } else {
+            *o->p++ = c;
+        }
+    }
+    return i;
+}
+
+static void _logger_out_json_str(_logger_out_t *o, const char *s, size_t n)
+{
+    _logger_out_char(o, '"');
+    _logger_out_json_chars(o, s, strnlen(s, n));
+    _logger_out_char(o, '"');
+}
+
+/* Escapes n chars for a quoted logfmt value. Returns how many fitted */
+static size_t _logger_out_logfmt_chars(_logger_out_t *o, const char *s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && o->end - o->p > 3; i++) {
+        unsigned char c = s[i];
+
+        if (c == '"' || c == '\\') {
+            *o->p++ = '\\';
+            *o->p++ = c;
+        } else if (c == '\n') {
+            *o->p++ = '\\'; *o->p++ = 'n';
+        } else if (c < ' ') {
+            *o->p++ = ' ';
+        } else {
+            *o->p++ = c;
+        }
+    }
+    return i;
+}
+
+static void _logger_out_logfmt_str(_logger_out_t *o, const char *s, size_t n)
+{
+    size_t i;
+
+    n = strnlen(s, n);
+    for (i = 0; i < n; i++) {
+        if (s[i] <= ' ' || s[i] == '=' || s[i] == '"' || s[i] == '\\') {
+            break;
+        }
+    }
+    if (n && i == n) {
+        /* Nothing to quote/escape */
+        _logger_out_put(o, s, n);
+        return;
+    }
+    _logger_out_char(o, '"');
+    _logger_out_logfmt_chars(o, s, n);
+    _logger_out_char(o, '"');
+}
+
+static inline void _logger_out_str(_logger_out_t *o, const char *s, size_t n, bool json)
+{
+    json ? _logger_out_json_str(o, s, n) : _logger_out_logfmt_str(o, s, n);
+}
+
+/* RFC 3339 time stamp (UTC, microseconds) */
+static void _logger_out_ts(_logger_out_t *o, const struct timespec *ts)
+{
+    static char date[32];
+    static time_t prev_sec = -1;
+    char usec[8];
+
+    if (ts->tv_sec != prev_sec) {
+        struct tm tm;
+        gmtime_r(&ts->tv_sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        prev_sec = ts->tv_sec;
+    }
+    _logger_out_put(o, date, 19);
+
+    unsigned long us = NTOU(ts->tv_nsec);
+    usec[0] = '.';
+    for (int i = 6; i > 0; i--, us /= 10) {
+        usec[i] = '0' + us % 10;
+    }
+    usec[7] = 'Z';
+    _logger_out_put(o, usec, sizeof(usec));
+}
+
+/* Decodes the next field of the line (see logger_log_fields()). NULL at the end */
+static const char *_logger_get_field(const char *p, logger_field_t *f, size_t *len)
+{
+    if ((f->type = *p) == LOGGER_FIELD_END) {
+        return NULL;
+    }
+    memcpy(&f->key, p + 1, sizeof(f->key));
+    p += 1 + sizeof(f->key);
+
+    switch (f->type) {
+    case LOGGER_FIELD_BOOL:
+        f->b = *p;
+        return p + 1;
+    case LOGGER_FIELD_STR: {
+        unsigned short slen;
+        memcpy(&slen, p, sizeof(slen));
+        f->s = p + sizeof(slen);
+        *len = slen;
+        return f->s + slen;
+    }
+    default:
+        memcpy(&f->i, p, 8);
+        return p + 8;
+    }
+}
+
+/* Appends the fields as ',"key":value' (JSON) or ' key=value' (logfmt & text) */
+static void _logger_out_fields(_logger_out_t *o, const logger_line_t *l, bool json)
+{
+    const char *p = l->str + l->fields;
+    logger_field_t f;
+    size_t len = 0;
+
+    while ((p = _logger_get_field(p, &f, &len))) {
+        _logger_out_char(o, json ? ',' : ' ');
+        if (json) {
+            _logger_out_json_str(o, f.key, ~0UL);
+            _logger_out_char(o, ':');
+        } else {
+            _logger_out_logfmt_str(o, f.key, ~0UL);
+            _logger_out_char(o, '=');
+        }
+        switch (f.type) {
+        case LOGGER_FIELD_INT:
+            _logger_out_int(o, f.i);
+            break;
+        case LOGGER_FIELD_UINT:
+            _logger_out_uint(o, f.u);
+            break;
+        case LOGGER_FIELD_BOOL:
+            f.b ? _logger_out_put(o, "true", 4) : _logger_out_put(o, "false", 5);
+            break;
+        case LOGGER_FIELD_STR:
+            _logger_out_str(o, f.s, len, json);
+            break;
+        case LOGGER_FIELD_DOUBLE:
+            if (json && !isfinite(f.d)) {
+                _logger_out_put(o, "null", 4); // Not representable in JSON
+            } else if (o->p < o->end) {
+                int n = snprintf(o->p, o->end - o->p + 1, "%.17g", f.d);
+                o->p += n < o->end - o->p ? n : o->end - o->p;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* One JSON object or logfmt line. Allocation free, only the reader escapes */
+static int _logger_format_structured(const logger_write_queue_t *wrq, const logger_line_t *l,
+                                        const char *str, char *linestr, size_t size, bool json)
+{
+    _logger_out_t o = { linestr, linestr + size - 3 }; // Room for "}\n"
+
+#define _LOGGER_OUT_KEY(k) (json ? _logger_out_put(&o, "\"" k "\":", sizeof(k) + 2) \
+                                 : _logger_out_put(&o, k "=", sizeof(k)))
+    if (json) {
+        _logger_out_char(&o, '{');
+    }
+    _LOGGER_OUT_KEY("ts");
+    if (json) {
+        _logger_out_char(&o, '"');
+        _logger_out_ts(&o, &l->ts);
+        _logger_out_char(&o, '"');
+    } else {
+        _logger_out_ts(&o, &l->ts);
+    }
+
+    _logger_out_char(&o, json ? ',' : ' ');
+    _LOGGER_OUT_KEY("level");
+    _logger_out_str(&o, _logger_level_name[l->level], ~0UL, json);
+
+    _logger_out_char(&o, json ? ',' : ' ');
+    _LOGGER_OUT_KEY("thread");
+    _logger_out_str(&o, wrq->thread_name, wrq->thread_name_len, json);
+
+    if (l->task[0]) {
+        _logger_out_char(&o, json ? ',' : ' ');
+        _LOGGER_OUT_KEY("task");
+        _logger_out_str(&o, l->task, sizeof(l->task), json);
+    }
+
+    _logger_out_char(&o, json ? ',' : ' ');
+    _LOGGER_OUT_KEY("src");
+    _logger_out_str(&o, l->file, ~0UL, json);
+
+    _logger_out_char(&o, json ? ',' : ' ');
+    _LOGGER_OUT_KEY("func");
+    _logger_out_str(&o, l->func, ~0UL, json);
+
+    _logger_out_char(&o, json ? ',' : ' ');
+    _LOGGER_OUT_KEY("line");
+    _logger_out_uint(&o, l->line);
+
+    _logger_out_char(&o, json ? ',' : ' ');
+    _LOGGER_OUT_KEY("msg");
+    _logger_out_str(&o, str, ~0UL, json);
+#undef _LOGGER_OUT_KEY
+
+    if (l->fields) {
+        _logger_out_fields(&o, l, json);
+    }
+    if (json) {
+        *o.p++ = '}';
     }
-    return time;
+    *o.p++ = '\n';
+
+    return o.p - linestr;
 }
 
-static int _logger_write_line(const logger_write_queue_t *wrq, const logger_line_t *l)
+/* Text format: the prefix & the message str, after the date line (if any) */
+static int _logger_format_text(const logger_write_queue_t *wrq, const logger_line_t *l, const char *str,
+                                const char *date, const char *time, char *linestr, size_t size)
 {
-    char linestr[LOGGER_LINE_SZ + LOGGER_MAX_PREFIX_SZ];
     const logger_line_colors_t *c = logger.theme;
 
     /* File/Function/Line */
@@ -117,171 +729,1239 @@ static int _logger_write_line(const logger_write_queue_t *wrq, const logger_line
     unsigned long msec = NTOM(l->ts.tv_nsec) % 1000;
     int sec            = l->ts.tv_sec % 60;
 
-    /* Format all together */
-    static int biggest_thread_name = 0;
-    if (wrq->thread_name_len > biggest_thread_name) {
-        biggest_thread_name = wrq->thread_name_len;
+    /* Thread name, or "thread/task" when printed by a logical task */
+    const char *name = wrq->thread_name;
+    int name_len = wrq->thread_name_len;
+    char task_name[_LOGGER_NAME_WIDTH_MAX + 1];
+
+    if (l->task[0]) {
+        name_len = snprintf(task_name, sizeof(task_name), "%s/%.*s", wrq->thread_name, (int)sizeof(l->task), l->task);
+        name = task_name;
     }
-    len = snprintf(linestr, sizeof(linestr),
+
+    /**
+     * Format all together.  The names are aligned on the widest seen so far,
+     * but a prerendered line can be made before a wider name is seen and
+     * printed after: then they are all aligned on the widest a name can be
+     * ("thread/task", a task can start at any time), so the lines made at
+     * any time have the same width.
+     */
+    int biggest_thread_name = logger.name_width_fixed ? _LOGGER_NAME_WIDTH_MAX
+                            : atomic_load_explicit(&logger.name_width, memory_order_relaxed);
+    if (name_len > biggest_thread_name && !logger.name_width_fixed) {
+        atomic_store_explicit(&logger.name_width, name_len, memory_order_relaxed);
+        biggest_thread_name = name_len;
+    }
+    len = snprintf(linestr, size,
             "%s%s:%02d.%03lu,%03lu [%s%s%s] %*s <%s%*s%s> %s\n",
-            _logger_get_date(l->ts.tv_sec, c),
-            _logger_get_time(l->ts.tv_sec, c),
+            date, time,
             sec, msec, usec,
             c->level[l->level], _logger_level_label[l->level], c->reset,
             LOGGER_MAX_SOURCE_LEN, start_of_src_str,
-            c->thread_name, biggest_thread_name, wrq->thread_name, c->reset, l->str);
-    /* Print */
-    return write(1, linestr, len);
+            c->thread_name, biggest_thread_name, name, c->reset, str);
+
+    return len < size ? len : size - 1;
 }
 
-static inline void _bubble_fuse_up(_logger_fuse_entry_t *fuse, int fuse_nr)
+/* LOGGER_OPT_PRERENDER: the writer makes the whole line in l->str, from its message. The date is left to the reader */
+int _logger_prerender_line(const logger_write_queue_t *wrq, logger_line_t *l, const char *msg)
 {
-    if (fuse_nr > 1 && fuse[0].ts > fuse[1].ts) {
-        register int i = 0;
-        _logger_fuse_entry_t newentry = fuse[0]; // Strictly bigger move up (stack empty ones at the end of smallers)
-        do { fuse[i] = fuse[i+1]; i++; } while (i < fuse_nr-1 && newentry.ts > fuse[i+1].ts);
-        fuse[i] = newentry;
+    static __thread _logger_time_t time;
+    int len;
+
+    len = _logger_format_text(wrq, l, msg, "", _logger_get_time(&time, l->ts.tv_sec, logger.theme),
+                                l->str, sizeof(l->str));
+    if (l->str[len-1] != '\n') {
+        l->str[len-1] = '\n'; // Truncated: still a line
     }
+    l->prerendered = len;
+    return len;
 }
 
-static inline void _bubble_fuse_down(_logger_fuse_entry_t *fuse, int fuse_nr)
+/* Message of the line (rendered[LOGGER_LINE_SZ] used if needed) */
+static const char *_logger_render(const logger_line_t *l, char *rendered)
 {
-    if (fuse_nr > 1 && fuse[fuse_nr-1].ts <= fuse[fuse_nr-2].ts) {
-        register int i = fuse_nr-1;
-        _logger_fuse_entry_t newentry = fuse[i]; // Smaller & same move down (so, stack empty ones at top of smallers)
-        do { fuse[i] = fuse[i-1]; i--; } while (i > 0 && newentry.ts <= fuse[i-1].ts);
-        fuse[i] = newentry;
+    if (l->render) {
+        /* Binary data. The text is made now, by the reader (see logger_reserve_line()) */
+        l->render(rendered, LOGGER_LINE_SZ, l->str);
+        return rendered;
     }
+    return l->str;
 }
 
-static inline int _logger_set_queue_entry(const logger_write_queue_t *wrq, _logger_fuse_entry_t *fuse)
+/* Same for the text format: the fields are added to the message, logfmt like */
+static const char *_logger_text_msg(const logger_line_t *l, char *rendered)
 {
-    unsigned int index = wrq->rd_idx;
+    if (l->fields) {
+        _logger_out_t o = { rendered, rendered + LOGGER_LINE_SZ - 1 };
 
-    if (wrq->lines[index].ready) { // when it's ready, we can proceed...
-        struct timespec ts = wrq->lines[index].ts;
-        fuse->ts = timespec_to_ns(ts);
-    } else {
-        fuse->ts = ~0; // Otherwise it's empty.
-        return 1;
+        _logger_out_put(&o, l->str, strlen(l->str));
+        _logger_out_fields(&o, l, false);
+        *o.p = 0;
+        return rendered;
     }
-    return 0;
+    return _logger_render(l, rendered);
 }
 
-static int _logger_enqueue_next_lines(_logger_fuse_entry_t *fuse, int fuse_nr, int empty_nr)
-{
-    logger_write_queue_t *wrq;
+/* Counters of a call site (LOGGER_OPT_PROFILE) */
+typedef struct {
+    atomic_ulong	key;		/* file << 16 | line (0: free). Claimed by the 1st to see the site */
+    const char		*file;
+    const char		*func;
+    unsigned int	line;
+    unsigned long	lines;		/* Lines printed (only counted by the reader) */
+    unsigned long	bytes;		/* Bytes printed */
+    unsigned long	wait_ns;	/* Time spent in the queues by the lines measured */
+    unsigned long	wait_nr;	/* Lines measured (1 out of LOGGER_PROFILE_SAMPLE) */
+    atomic_ulong	dropped;	/* Lines dropped (counted by the writers) */
+} _logger_site_t;
 
-    if (fuse[0].ts != ~0) { // This one should have been processed. Freeing it ...
-        wrq = fuse[0].wrq;
+static _logger_site_t *_logger_profile;
 
-        wrq->lines[wrq->rd_idx].ready = false; // Free this line for the writer thread
-        wrq->rd_idx = ++wrq->rd_seq % wrq->lines_nr;
-        empty_nr += _logger_set_queue_entry(wrq, &fuse[0]); // Enqueue the next line
+static _logger_site_t *_logger_profile_site(const char *file, const char *func, unsigned int line)
+{
+    /* The lines above 65535 share their site with another one: good enough */
+    unsigned long key = (uintptr_t)file << 16 | (line & 0xffff);
+    unsigned long i = (key * 0x9e3779b97f4a7c15UL) >> 32;
 
-        _bubble_fuse_up(fuse, fuse_nr); /* Let him find it's place */
-    }
-    /* Let see if there is something new in the empty queues... */
-    int rv = 0;
-    for (int i=0, last=fuse_nr-1; i<empty_nr; i++) {
-        rv += _logger_set_queue_entry(fuse[last].wrq, &fuse[last]);
-        _bubble_fuse_down(fuse, fuse_nr);
+    for (int n = 0; n < LOGGER_PROFILE_SITES; n++, i++) {
+        _logger_site_t *s = &_logger_profile[i & (LOGGER_PROFILE_SITES - 1)];
+        unsigned long k = atomic_load_explicit(&s->key, memory_order_relaxed);
+
+        if (k == key) {
+            return s;
+        }
+        if (!k) {
+            if (atomic_compare_exchange_strong(&s->key, &k, key)) {
+                s->file = file;
+                s->func = func;
+                s->line = line;
+                return s;
+            }
+            if (k == key) {
+                return s; // Claimed by another one meanwhile
+            }
+        }
     }
-    return rv; // return the number of remaining empty queues ...
+    return NULL; // Full: not counted
 }
 
-static inline int _logger_init_lines_queue(_logger_fuse_entry_t *fuse, int fuse_nr)
+static void _logger_profile_line(const logger_line_t *l, int len)
 {
-    memset(fuse, 0, fuse_nr * sizeof(_logger_fuse_entry_t));
+    static unsigned int sample;
+    _logger_site_t *s = _logger_profile_site(l->file, l->func, l->line);
 
-    for (int i=0 ; i<fuse_nr; i++) {
-        fuse[i].ts  = ~0; // Init all the queues as if they were empty
-        fuse[i].wrq = logger.queues[i];
+    if (!s) {
+        return;
+    }
+    s->lines++;
+    s->bytes += len;
+    if (!(++sample & (LOGGER_PROFILE_SAMPLE - 1))) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        s->wait_ns += elapsed_ns(l->ts, now);
+        s->wait_nr++;
     }
-    return fuse_nr; // Number of empty queues (all)
 }
 
-void *_thread_logger(void)
+void _logger_profile_drop(const char *file, const char *func, unsigned int line)
 {
-    bool running = logger.running;
+    _logger_site_t *s;
 
-    dbg_printf("<logger-thd-read> Starting...\n");
+    if (_logger_profile && (s = _logger_profile_site(file, func, line))) {
+        atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+    }
+}
 
-    while (running) {
-        int empty_nr = 0;
-        int really_empty = 0;
-        int fuse_nr = logger.queues_nr;
-
-        if (!fuse_nr) {
-            dbg_printf("<logger-thd-read> Wake me up when there is somet'n... Zzz\n");
-            atomic_store(&logger.waiting, 1);
-            if (futex_wait(&logger.waiting, 1) < 0 && errno != EAGAIN) {
-                dbg_printf("<logger-thd-read> ERROR: %m !\n");
-                break;
-            }
-            if (!logger.running) {
-                break;
-            }
-            atomic_store(&logger.reload, 0);
-            continue;
-        }
-        _logger_fuse_entry_t fuse_queue[fuse_nr];
+int _logger_profile_init(void)
+{
+    if (!(_logger_profile = calloc(LOGGER_PROFILE_SITES, sizeof(_logger_site_t)))) {
+        return -1;
+    }
+    return 0;
+}
 
-        dbg_printf("<logger-thd-read> (Re)Loading... _logger_fuse_entry_t = %d x %lu bytes (%lu bytes total)\n",
-                        fuse_nr, sizeof(_logger_fuse_entry_t), sizeof(fuse_queue));
+void _logger_profile_deinit(void)
+{
+    free(_logger_profile);
+    _logger_profile = NULL;
+}
 
-        empty_nr = _logger_init_lines_queue(fuse_queue, fuse_nr);
+static int _logger_site_cmp(const void *a, const void *b)
+{
+    const _logger_site_t *sa = *(const _logger_site_t **)a, *sb = *(const _logger_site_t **)b;
+    unsigned long na = sa->lines + atomic_load(&sa->dropped), nb = sb->lines + atomic_load(&sb->dropped);
 
-        while (1) {
-            empty_nr = _logger_enqueue_next_lines(fuse_queue, fuse_nr, empty_nr);
+    return na < nb ? 1 : na > nb ? -1 : 0;
+}
 
-            if (atomic_compare_exchange_strong(&logger.reload, &(int){ 1 }, 0)) {
-                break;
-            }
-            if (fuse_queue[0].ts == ~0) {
-                logger.empty = true;
-                if (!logger.running) {
-                    /* We want to terminate when all the queues are empty ! */
-                    running = false;
-                    break; // while (1)
-                }
-                if (really_empty < 5) {
-                    int wait = 1 << really_empty++;
-                    dbg_printf("<logger-thd-read> Print queue empty. Double check in %d us ...\n", wait);
-                    usleep(wait);
-                    /**
-                     * Double-check multiple times if the queue is really empty.
-                     * This is avoid the writers to wakeup too frequently the reader in case of burst.
-                     * Waking him up through the futex also takes time and the goal is to lower the
-                     * time spent in logger_printf() as much as possible ...
-                     */
-                    continue;
-                }
-                really_empty = 0;
-                dbg_printf("<logger-thd-read> Print queue REALLY empty ... Zzz\n");
-                atomic_store(&logger.waiting, 1);
-                if (futex_wait(&logger.waiting, 1) < 0 && errno != EAGAIN) {
-                    dbg_printf("<logger-thd-read> ERROR: %m !\n");
-                    running = false;
-                    break;
-                }
-                continue;
-            }
-            logger.empty = false;
-            really_empty = 0;
+int logger_dump_profile(int fd, int top)
+{
+    _logger_site_t **sites;
+    int nr = 0;
 
-            logger_write_queue_t *wrq = fuse_queue[0].wrq;
-            if ( _logger_write_line(wrq, &wrq->lines[wrq->rd_idx]) < 0 ) {;
-                /**
-                 * In this case we loose the line but we must continue to empty the queues ...
-                 * otherwise all the queues gets full and all the threads are stuck on it
-                 * (this can happen if the disk is full, terminal stuck, ...)
-                 */
-                dbg_printf("<logger-thd-read> logger_write_line(): %m\n");
-            }
+    if (!_logger_profile) {
+        return errno = EINVAL, -1;
+    }
+    if (!(sites = malloc(LOGGER_PROFILE_SITES * sizeof(*sites)))) {
+        return -1;
+    }
+    /* Read while the reader counts: a site can be a line late, nothing more */
+    for (int i = 0; i < LOGGER_PROFILE_SITES; i++) {
+        if (atomic_load(&_logger_profile[i].key) && _logger_profile[i].file) {
+            sites[nr++] = &_logger_profile[i];
         }
     }
-    dbg_printf("<logger-thd-read> Exit\n");
+    qsort(sites, nr, sizeof(*sites), _logger_site_cmp);
+    if (top > 0 && top < nr) {
+        nr = top;
+    }
+    dprintf(fd, "%12s %14s %12s %10s  %s\n", "lines", "bytes", "avg wait us", "dropped", "call site");
+    for (int i = 0; i < nr; i++) {
+        const _logger_site_t *s = sites[i];
+
+        dprintf(fd, "%12lu %14lu %12.1f %10lu  %s:%s:%u\n", s->lines, s->bytes,
+                    s->wait_nr ? s->wait_ns / 1000.0 / s->wait_nr : 0.0, atomic_load(&s->dropped),
+                    s->file, s->func ?: "?", s->line);
+    }
+    free(sites);
+    return nr;
+}
+
+static int _logger_format(const logger_write_queue_t *wrq, const logger_line_t *l, char *linestr, size_t size)
+{
+    static _logger_time_t time;
+    const logger_line_colors_t *c = logger.theme;
+    char rendered[LOGGER_LINE_SZ];
+
+    if (l->prerendered) {
+        /* Made by the writer (LOGGER_OPT_PRERENDER) or its group: only the date line is ours */
+        int len = snprintf(linestr, size, "%s%.*s", _logger_get_date(l->ts.tv_sec, c), l->prerendered, l->str);
+        return len < size ? len : size - 1;
+    }
+    if (wrq->queue_idx < 0) {
+        wrq = logger.queues[l->from]; // Merged by a group: the queue it was written in
+    }
+    switch (logger.format) {
+    case LOGGER_FORMAT_JSON:
+        return _logger_format_structured(wrq, l, _logger_render(l, rendered), linestr, size, true);
+    case LOGGER_FORMAT_LOGFMT:
+        return _logger_format_structured(wrq, l, _logger_render(l, rendered), linestr, size, false);
+    default:
+        break;
+    }
+    return _logger_format_text(wrq, l, _logger_text_msg(l, rendered), _logger_get_date(l->ts.tv_sec, c),
+                                _logger_get_time(&time, l->ts.tv_sec, c), linestr, size);
+}
+
+static int _logger_format_line(const logger_write_queue_t *wrq, const logger_line_t *l, char *linestr, size_t size)
+{
+    int len = _logger_format(wrq, l, linestr, size);
+
+    if (_logger_profile) {
+        _logger_profile_line(l, len);
+    }
+    return len;
+}
+
+static void _logger_output_put(const char *s, size_t n)
+{
+    if (_logger_output.size - _logger_output.len < n) {
+        _logger_output_flush();
+    }
+    memcpy(_logger_output.buf + _logger_output.len, s, n);
+    _logger_output.len += n;
+}
+
+/* Writes the output buffer, the data and a '\n' with a single writev(): the data is not copied */
+static int _logger_output_flush_with(const void *data, size_t size)
+{
+    struct iovec iov[3] = {
+        { _logger_output.buf, _logger_output.len },
+        { (void *)data, size },
+        { "\n", 1 },
+    };
+    struct iovec *v = iov;
+    int iovcnt = size && ((const char *)data)[size-1] == '\n' ? 2 : 3;
+
+    if (_logger_output.ring) {
+        /* The buffer is spliced. The data is released right after: copied */
+        if (_logger_output_flush() < 0) {
+            return -1;
+        }
+        v++, iovcnt--;
+    } else {
+        _logger_output.len = 0;
+    }
+    if (logger.opts & LOGGER_OPT_GZIP) {
+        return _logger_gzip_writev(v, iovcnt, _logger_index.buf_ms) < 0 ? -1 : 0;
+    }
+    size_t done = 0;
+
+    while (iovcnt) {
+        ssize_t r = writev(1, v, iovcnt);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += r;
+        while (iovcnt && r >= v->iov_len) {
+            r -= v->iov_len;
+            v++, iovcnt--;
+        }
+        if (iovcnt) {
+            v->iov_base = (char *)v->iov_base + r;
+            v->iov_len -= r;
+        }
+    }
+    if (_logger_index.fd >= 0) {
+        _logger_index_written(done);
+    }
+    return iovcnt ? -1 : 0;
+}
+
+/* Classic hex dump: "    offset  16 bytes in hex  |ascii|" */
+static void _logger_output_hexdump(const unsigned char *b, size_t n)
+{
+    const char *hex = _logger_hex;
+
+    for (size_t off = 0; off < n; off += 16) {
+        char *p;
+        int i;
+
+        if (_logger_output.size - _logger_output.len < 96) {
+            _logger_output_flush();
+        }
+        p = _logger_output.buf + _logger_output.len;
+        memset(p, ' ', 64);
+        for (i = 0; i < 8; i++) {
+            p[4 + i] = hex[(off >> (28 - 4 * i)) & 15];
+        }
+        for (i = 0; i < 16 && off + i < n; i++) {
+            unsigned char c = b[off + i];
+            char *h = p + 14 + i * 3 + (i >= 8);
+            h[0] = hex[c >> 4];
+            h[1] = hex[c & 15];
+            p[64 + i] = c >= ' ' && c < 127 ? c : '.';
+        }
+        p[63] = '|';
+        p[64 + i] = '|';
+        p[65 + i] = '\n';
+        _logger_output.len += 66 + i;
+    }
+}
+
+/* Attachment as a structured value: plain hex, or escaped */
+static void _logger_output_value(const unsigned char *b, size_t n, bool hex, bool json)
+{
+    while (n) {
+        if (_logger_output.size - _logger_output.len < 256) {
+            _logger_output_flush();
+        }
+        _logger_out_t o = { _logger_output.buf + _logger_output.len, _logger_output.buf + _logger_output.size };
+        size_t done;
+
+        if (hex) {
+            done = (o.end - o.p) / 2 < n ? (o.end - o.p) / 2 : n;
+            for (size_t i = 0; i < done; i++) {
+                *o.p++ = _logger_hex[b[i] >> 4];
+                *o.p++ = _logger_hex[b[i] & 15];
+            }
+        } else {
+            done = json ? _logger_out_json_chars(&o, (const char *)b, n)
+                        : _logger_out_logfmt_chars(&o, (const char *)b, n);
+        }
+        _logger_output.len = o.p - _logger_output.buf;
+        b += done;
+        n -= done;
+    }
+}
+
+/* Adds the attachment of the line (see logger_printf_attach()) to the output, then releases it */
+static int _logger_output_attach(const logger_line_t *l)
+{
+    const logger_attach_t *a = &l->attach;
+    bool json = logger.format == LOGGER_FORMAT_JSON;
+    int ret = 0;
+
+    if (logger.format == LOGGER_FORMAT_TEXT) {
+        if (a->mode == LOGGER_ATTACH_RAW) {
+            ret = _logger_output_flush_with(a->buf, a->len);
+        } else {
+            _logger_output_hexdump(a->buf, a->len);
+        }
+    } else {
+        /* Reopen the line ("}\n" or "\n") to add the attachment as its last field */
+        _logger_output.len -= json ? 2 : 1;
+        json ? _logger_output_put(",\"attach\":\"", 11) : _logger_output_put(" attach=\"", 9);
+        _logger_output_value(a->buf, a->len, a->mode == LOGGER_ATTACH_HEX, json);
+        json ? _logger_output_put("\"}\n", 3) : _logger_output_put("\"\n", 2);
+    }
+    if (a->release) {
+        a->release(a->buf, a->len, a->arg);
+    }
+    return ret;
+}
+
+/* Formats l in the output buffer, with its attachment */
+static inline void _logger_output_line(const logger_write_queue_t *wrq, const logger_line_t *l)
+{
+    if (_logger_output.size - _logger_output.len < _LOGGER_OUTPUT_LINE_SZ) {
+        _logger_output_flush();
+    }
+    if (_logger_index.fd >= 0) {
+        if (logger.unordered) {
+            /* Switched at runtime: the entries so far stay right, the rest is only found by a scan */
+            dbg_printf("<logger-thd-read> Unordered output: index stopped\n");
+            _logger_output_flush();
+            if (logger.opts & LOGGER_OPT_GZIP) {
+                _logger_gzip_handoff(); // Its members are indexed by the compression thread
+                _logger_gzip_wait(NULL);
+            }
+            _logger_index_deinit();
+        } else if (logger.opts & LOGGER_OPT_GZIP) {
+            if (!_logger_output.len) {
+                _logger_index.buf_ms = l->ts.tv_sec * 1000UL + NTOM(l->ts.tv_nsec);
+            }
+        } else {
+            _logger_index_line(l);
+        }
+    }
+    _logger_output.len += _logger_format_line(wrq, l, _logger_output.buf + _logger_output.len,
+                                                    _logger_output.size - _logger_output.len);
+    if (l->attach.buf) {
+        _logger_output_attach(l);
+    }
+}
+
+/* Writes what the runs left in the output buffer (LOGGER_OPT_SPLICE, see _logger_take_run()) */
+static inline void _logger_output_flush_pending(void)
+{
+    if (_logger_output.len > _logger_output.spliced) {
+        _logger_output_flush();
+    }
+}
+
+static inline void _bubble_fuse_up(_logger_fuse_entry_t *fuse, int fuse_nr)
+{
+    if (fuse_nr > 1 && fuse[0].ts > fuse[1].ts) {
+        register int i = 0;
+        _logger_fuse_entry_t newentry = fuse[0]; // Strictly bigger move up (stack empty ones at the end of smallers)
+        do { fuse[i] = fuse[i+1]; i++; } while (i < fuse_nr-1 && newentry.ts > fuse[i+1].ts);
+        fuse[i] = newentry;
+    }
+}
+
+static inline void _bubble_fuse_down(_logger_fuse_entry_t *fuse, int fuse_nr)
+{
+    if (fuse_nr > 1 && fuse[fuse_nr-1].ts <= fuse[fuse_nr-2].ts) {
+        register int i = fuse_nr-1;
+        _logger_fuse_entry_t newentry = fuse[i]; // Smaller & same move down (so, stack empty ones at top of smallers)
+        do { fuse[i] = fuse[i-1]; i--; } while (i > 0 && newentry.ts <= fuse[i-1].ts);
+        fuse[i] = newentry;
+    }
+}
+
+/* Oldest of l (from the queue, or NULL) and the next line of the signal lane */
+static logger_line_t *_logger_get_signal_line(const logger_write_queue_t *wrq, logger_line_t *l)
+{
+    logger_line_t *s = (logger_line_t *)&wrq->sig_lines[wrq->sig_rd_idx];
+
+    if (l) {
+        return timespec_to_ns(s->ts) < timespec_to_ns(l->ts) ? s : l;
+    }
+    /**
+     * The handler maybe interrupted the thread in the middle of a line.
+     * This one is older: let it be published first.  As the queue looks
+     * empty meanwhile, the others wait for it too (_logger_is_in_order()).
+     */
+    unsigned long wmark = atomic_load(&wrq->wr_wmark);
+
+    return wmark != LOGGER_WMARK_NONE && wmark <= timespec_to_ns(s->ts) ? NULL : s;
+}
+
+static inline logger_line_t *_logger_get_next_line(const logger_write_queue_t *wrq)
+{
+    logger_line_t *l = NULL;
+
+    /* Acquire: the lines counted in the write sequence are complete */
+    if (atomic_load_explicit(&wrq->wr_seq, memory_order_acquire)
+            != atomic_load_explicit(&wrq->rd_seq, memory_order_relaxed)) {
+        l = &wrq->lines[wrq->rd_idx];
+    /**
+     * The writer spills in the overflow only when the queue is full and
+     * comes back only when the overflow is empty.  So, when both have
+     * something, the lines of the queue are always the oldest ones.
+     */
+    } else if (atomic_load_explicit(&wrq->ovf_wr_seq, memory_order_acquire)
+            != atomic_load_explicit(&wrq->ovf_rd_seq, memory_order_relaxed)) {
+        l = &wrq->ovf_lines[wrq->ovf_rd_idx];
+    }
+    /* Same cache line as wr_seq: nearly free when the lane is empty (always, almost) */
+    if (__builtin_expect(atomic_load_explicit(&wrq->sig_wr_seq, memory_order_acquire)
+            != atomic_load_explicit(&wrq->sig_rd_seq, memory_order_relaxed), 0)) {
+        return _logger_get_signal_line(wrq, l);
+    }
+    return l;
+}
+
+static inline int _logger_set_queue_entry(const logger_write_queue_t *wrq, _logger_fuse_entry_t *fuse)
+{
+    logger_line_t *l = _logger_get_next_line(wrq);
+
+    if (l) { // when it's ready, we can proceed...
+        struct timespec ts = l->ts;
+        fuse->ts = timespec_to_ns(ts);
+        fuse->line = l;
+    } else {
+        fuse->ts = ~0; // Otherwise it's empty.
+        return 1;
+    }
+    return 0;
+}
+
+static inline void _logger_free_line(logger_write_queue_t *wrq, logger_line_t *l)
+{
+    /* Free this line for the writer thread */
+    if (l == &wrq->lines[wrq->rd_idx]) {
+        wrq->rd_idx = (wrq->rd_idx + 1) % wrq->lines_nr;
+        _logger_seq_publish(&wrq->rd_seq, 1);
+    } else if (wrq->sig_lines && l == &wrq->sig_lines[wrq->sig_rd_idx]) {
+        wrq->sig_rd_idx = (wrq->sig_rd_idx + 1) % LOGGER_SIGNAL_LINES;
+        _logger_seq_publish(&wrq->sig_rd_seq, 1);
+    } else {
+        wrq->ovf_rd_idx = (wrq->ovf_rd_idx + 1) % LOGGER_OVERFLOW_LINES;
+        _logger_seq_publish(&wrq->ovf_rd_seq, 1);
+    }
+}
+
+static int _logger_enqueue_next_lines(_logger_fuse_entry_t *fuse, int fuse_nr, int empty_nr,
+                                            bool printed, unsigned long *safe_ts)
+{
+    logger_write_queue_t *wrq;
+
+    if (printed && fuse[0].ts != ~0) { // This one should have been processed. Freeing it ...
+        wrq = fuse[0].wrq;
+
+        _logger_free_line(wrq, fuse[0].line);
+        if (_logger_set_queue_entry(wrq, &fuse[0])) { // Enqueue the next line
+            /* Its next line may be on the way. Check it again (_logger_is_in_order()) */
+            *safe_ts = 0;
+            empty_nr++;
+        }
+
+        _bubble_fuse_up(fuse, fuse_nr); /* Let him find it's place */
+    }
+    /* Let see if there is something new in the empty queues... */
+    int rv = 0;
+    for (int i=0, last=fuse_nr-1; i<empty_nr; i++) {
+        rv += _logger_set_queue_entry(fuse[last].wrq, &fuse[last]);
+        _bubble_fuse_down(fuse, fuse_nr);
+    }
+    return rv; // return the number of remaining empty queues ...
+}
+
+/**
+ * Queues merged by r: the ones of its group, the queues of the groups for
+ * the reader (queues = NULL, see logger.groups), or all of them.
+ */
+static int _logger_sources(const _logger_reader_t *r, logger_write_queue_t ***queues)
+{
+    if (r->group) {
+        int nr = logger.queues_nr - r->group->first;
+
+        *queues = logger.queues + r->group->first;
+        return nr < 0 ? 0 : nr < LOGGER_GROUP_QUEUES ? nr : LOGGER_GROUP_QUEUES;
+    }
+    if (logger.groups) {
+        *queues = NULL;
+        return logger.groups_nr;
+    }
+    *queues = logger.queues;
+    return logger.queues_nr;
+}
+
+static void _logger_reclaim_queues(const _logger_reader_t *r)
+{
+    static time_t last_check = 0;
+    logger_write_queue_t **queues;
+    int queues_nr = _logger_sources(r, &queues);
+    struct timespec now;
+    bool check_pids = false;
+
+    if (!queues) {
+        return; // The groups do it
+    }
+
+    if (logger.shared) {
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        check_pids = now.tv_sec - last_check >= LOGGER_RECLAIM_INTERVAL;
+    }
+    if (!check_pids && !atomic_load(&logger.released)) {
+        return;
+    }
+    if (check_pids) {
+        last_check = now.tv_sec;
+    }
+    /**
+     * The threads who exited without freeing their queue (see
+     * _logger_thread_exit()) left them to us.  Same for a worker process who
+     * crashed (or just exited without releasing its queues).  Once what they
+     * wrote is printed, the queues are given back (for a crashed process, the
+     * line it was maybe writing is lost).
+     */
+    for (int i=0; i<queues_nr; i++) {
+        logger_write_queue_t *wrq = queues[i];
+        unsigned long owner = atomic_load(&wrq->owner);
+        pid_t pid = _LOGGER_OWNER_PID(owner);
+        bool released;
+
+        if (!pid) {
+            continue; // Free
+        }
+        if (!(released = atomic_load(&wrq->released))) {
+            if (!check_pids || pid == logger.reader_pid) {
+                continue;
+            }
+            if (kill(pid, 0) == 0 || errno != ESRCH) {
+                continue; // Still alive
+            }
+        }
+        if (_logger_get_next_line(wrq)) {
+            continue; // Not yet empty. Next time...
+        }
+        if (atomic_load(&wrq->owner) != owner) {
+            continue; // Changed since its pid was checked: not the owner who is gone
+        }
+        if (released && !atomic_compare_exchange_strong(&wrq->released, &(int){ 1 }, 0)) {
+            continue; // Taken back by a new thread (see _logger_take_released_queue())
+        }
+        dbg_printf("<logger-thd-read> Thread/process %d is gone. Releasing its queue %d\n", pid, wrq->queue_idx);
+        wrq->wr_idx = wrq->rd_idx;
+        atomic_store(&wrq->wr_seq, atomic_load(&wrq->rd_seq));
+        wrq->ovf_wr_idx = wrq->ovf_rd_idx;
+        atomic_store(&wrq->ovf_wr_seq, atomic_load(&wrq->ovf_rd_seq));
+        wrq->sig_wr_idx = wrq->sig_rd_idx; // (A held line of a dead process: lost with it)
+        atomic_store(&wrq->sig_wr_seq, atomic_load(&wrq->sig_rd_seq));
+        wrq->ovf_used = false;
+        wrq->lost = 0;
+        atomic_store(&wrq->wr_wmark, LOGGER_WMARK_NONE);
+        if (released) {
+            /* (Counted only by the threads of this process) */
+            int n = atomic_load(&logger.released);
+            while (n > 0 && !atomic_compare_exchange_weak(&logger.released, &n, n - 1));
+        }
+        /* Nobody else can change it: its owner is gone, and a taken queue can't be claimed */
+        atomic_compare_exchange_strong(&wrq->owner, &owner, owner & ~0xffffffffUL);
+        atomic_fetch_add(&logger.reload, 1); // Out of the merge
+    }
+}
+
+/* End of a step of the reader: what was taken from the queues is written. Tells it to logger_flush() */
+static inline void _logger_signal_flushers(void)
+{
+    if (atomic_load_explicit(_logger_flushers(), memory_order_relaxed)) {
+        _logger_output_flush_pending();
+        if (logger.opts & LOGGER_OPT_GZIP) {
+            _logger_gzip_handoff(); // Written once compressed (see _logger_flush())
+        }
+        atomic_fetch_add(_logger_flushed(), 1);
+        futex_wake(_logger_flushed(), INT_MAX);
+    }
+}
+
+static bool _logger_has_lines(const _logger_reader_t *r)
+{
+    logger_write_queue_t **queues;
+    int queues_nr = _logger_sources(r, &queues);
+
+    for (int i=0; i<queues_nr; i++) {
+        if (_logger_get_next_line(queues ? queues[i] : &logger.groups[i].queue)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int _logger_sleep(const _logger_reader_t *r, atomic_int *waiting)
+{
+    atomic_store(waiting, 1);
+
+    /* A line published before the writers could see us sleeping (see _logger_wakeup()) ? */
+    if (_logger_has_lines(r)) {
+        atomic_compare_exchange_strong(waiting, &(int){ 1 }, 0);
+        return 0;
+    }
+
+    if (logger.shared) {
+        /* Wake up from time to time to check the dead processes */
+        struct timespec ts = { .tv_sec = LOGGER_RECLAIM_INTERVAL };
+        if (futex_timed_wait(waiting, 1, &ts) < 0 && errno != EAGAIN && errno != ETIMEDOUT) {
+            return -1;
+        }
+        return 0;
+    }
+    if (futex_wait(waiting, 1) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A group with nothing on the way (wmark NONE) can still have lines not yet
+ * taken from its queues: look at them directly.  False if there is one.
+ */
+static bool _logger_group_is_quiet(const logger_write_queue_t *gq, unsigned long *safe)
+{
+    const logger_group_t *g = &logger.groups[-1 - gq->queue_idx];
+    int last = g->first + LOGGER_GROUP_QUEUES < logger.queues_nr ? g->first + LOGGER_GROUP_QUEUES : logger.queues_nr;
+
+    for (int i=g->first; i<last; i++) {
+        unsigned long wmark = atomic_load(&logger.queues[i]->wr_wmark);
+
+        if (wmark == LOGGER_WMARK_NONE) {
+            if (_logger_get_next_line(logger.queues[i])) {
+                return false;
+            }
+        } else if (wmark < *safe) {
+            *safe = wmark;
+        }
+    }
+    return true;
+}
+
+/* Something was published in the queues seen empty */
+static bool _logger_empty_refilled(const _logger_fuse_entry_t *fuse, int fuse_nr, int empty_nr)
+{
+    for (int i=fuse_nr-empty_nr; i<fuse_nr; i++) {
+        if (_logger_get_next_line(fuse[i].wrq)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool _logger_is_in_order(_logger_fuse_entry_t *fuse, int fuse_nr, int empty_nr, unsigned long *safe_ts)
+{
+    if (fuse[0].ts <= *safe_ts) {
+        return true;
+    }
+    /**
+     * The queues having lines are already sorted.  But an empty one can
+     * have a line on the way with an older time stamp (the writer was
+     * waiting for a free place, or was preempted, ...).  So look at what
+     * they are writing.  Those writing nothing will have a time stamp newer
+     * than now, so the lines up to now (or up to the oldest one being
+     * written) can go without having to look again.
+     */
+    struct timespec now;
+    unsigned long safe = ~0;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    /**
+     * A writer announces its line without a fence (see _logger_get_time()):
+     * not seen yet, it took its time stamp LOGGER_ORDER_SLACK_US ago at
+     * most.  Only the lines older than that are safe, so the 1st one may
+     * have to wait a few moments (not more, if the clock went backward).
+     */
+    unsigned long first = timespec_to_ns(now);
+    while (timespec_to_ns(now) < fuse[0].ts + UTON(LOGGER_ORDER_SLACK_US)
+            && timespec_to_ns(now) - first < UTON(LOGGER_ORDER_SLACK_US)) {
+        clock_gettime(CLOCK_REALTIME, &now);
+    }
+    _logger_clock_fence();
+
+    for (int i=fuse_nr-empty_nr; i<fuse_nr; i++) {
+        unsigned long wmark = atomic_load(&fuse[i].wrq->wr_wmark);
+
+        if (wmark == LOGGER_WMARK_NONE) {
+            if (_logger_get_next_line(fuse[i].wrq)) {
+                return false; // Published meanwhile. Let it be merged first.
+            }
+            if (fuse[i].wrq->queue_idx < 0 && !_logger_group_is_quiet(fuse[i].wrq, &safe)) {
+                return false; // Same, not yet in the queue of its group
+            }
+            continue;
+        }
+        if (wmark < safe) {
+            safe = wmark;
+        }
+    }
+    unsigned long unseen = timespec_to_ns(now) - UTON(LOGGER_ORDER_SLACK_US); // Oldest line not yet announced
+
+    if (safe == ~0) {
+        /* Nothing on the way. (Newer than that if the clock went backward) */
+        safe = fuse[0].ts > unseen ? fuse[0].ts : unseen;
+    } else if (unseen < safe) {
+        safe = unseen;
+    }
+    *safe_ts = safe;
+    return fuse[0].ts <= safe;
+}
+
+static int _logger_drain_queues(_logger_fuse_entry_t *fuse, int fuse_nr)
+{
+    int total = 0;
+
+    /**
+     * No merge here: each queue is emptied in turn (one lap of its lines
+     * at most to be fair with the others) and what was taken from it is
+     * sent with a single write.
+     */
+    for (int i=0; i<fuse_nr; i++) {
+        logger_write_queue_t *wrq = fuse[i].wrq;
+        logger_line_t *l;
+        int count = 0;
+        bool block = false;
+
+        /* (A block is never cut: its lines are all there) */
+        while ((count < wrq->lines_nr || block) && (l = _logger_get_next_line(wrq))) {
+            _logger_output_line(wrq, l);
+            block = l->block;
+            _logger_free_line(wrq, l);
+            count++;
+        }
+        if (count && _logger_output_flush() < 0) {
+            dbg_printf("<logger-thd-read> logger_output_flush(): %m\n");
+        }
+        total += count;
+    }
+    return total;
+}
+
+static inline int _logger_init_lines_queue(_logger_reader_t *r)
+{
+    _logger_fuse_entry_t *fuse = r->fuse;
+    logger_write_queue_t **queues;
+    int queues_nr = _logger_sources(r, &queues), fuse_nr = 0;
+
+    for (int i=0 ; i<queues_nr; i++) {
+        logger_write_queue_t *wrq = queues ? queues[i] : &logger.groups[i].queue;
+
+        /**
+         * The free queues are left out, so the merge costs only what the
+         * living threads need.  Reusing one triggers a reload.  Not in the
+         * shared mode: the other processes can't trigger it ...
+         */
+        if (!logger.shared && _logger_queue_free(wrq) && !_logger_get_next_line(wrq)) {
+            continue;
+        }
+        fuse[fuse_nr].ts   = ~0; // Init all the queues as if they were empty
+        fuse[fuse_nr].wrq  = wrq;
+        fuse[fuse_nr].line = NULL;
+        fuse_nr++;
+    }
+    return fuse_nr; // Number of empty queues (all)
+}
+
+typedef enum {
+    _LOGGER_STEP_BUSY,		/* Something was done. Call again */
+    _LOGGER_STEP_HOLD,		/* Waiting for a late line (see _logger_is_in_order()) */
+    _LOGGER_STEP_EMPTY,		/* Nothing to print */
+} _logger_step_t;
+
+static inline _logger_step_t _logger_step_empty(_logger_reader_t *r)
+{
+    if (r->group) {
+        atomic_store(&r->group->queue.wr_wmark, LOGGER_WMARK_NONE); // See _logger_group_is_quiet()
+    } else {
+        logger.empty = true;
+    }
+    return _LOGGER_STEP_EMPTY;
+}
+
+/**
+ * For the reader, a group is like a writer: the time stamp of the line it
+ * is on (or of an older one on the way in its queues) is its watermark.
+ */
+static inline void _logger_group_wmark(const _logger_reader_t *r)
+{
+    if (r->group) {
+        unsigned long wmark = r->fuse[0].ts < r->safe_ts ? r->fuse[0].ts : r->safe_ts;
+
+        atomic_store(&r->group->queue.wr_wmark, wmark > LOGGER_WMARK_PENDING ? wmark : LOGGER_WMARK_PENDING);
+    }
+}
+
+static _logger_reader_t _logger_reader = { .mx = PTHREAD_MUTEX_INITIALIZER };
+
+static void _logger_merge_reset(_logger_reader_t *r)
+{
+    if (r->fuse) {
+        munmap(r->fuse, r->fuse_sz);
+    }
+    r->fuse = NULL;
+    r->fuse_nr = 0;
+}
+
+void _logger_reader_reset(void)
+{
+    _logger_merge_reset(&_logger_reader);
+}
+
+/* Copies the line in the queue of the group, formatted there (text) to share the work with the other groups */
+static void _logger_group_put(logger_group_t *g, const logger_write_queue_t *wrq, const logger_line_t *l)
+{
+    logger_write_queue_t *gq = &g->queue;
+    logger_line_t *gl = &gq->lines[gq->wr_idx];
+
+    while (_logger_ring_full(&gq->wr_seq, &gq->rd_seq, &gq->rd_seq_seen, gq->lines_nr - gq->block_used)) {
+        /* Full. The reader is late, its lines are older: wait for it */
+        _logger_wakeup(_logger_waiting());
+        usleep(1);
+    }
+    memcpy(&gl->ts, &l->ts, offsetof(logger_line_t, str) - offsetof(logger_line_t, ts));
+    gl->from = wrq->queue_idx;
+
+    if (logger.format == LOGGER_FORMAT_TEXT && !l->prerendered) {
+        char rendered[LOGGER_LINE_SZ];
+
+        _logger_prerender_line(wrq, gl, _logger_text_msg(l, rendered));
+        gl->render = NULL;
+        gl->fields = 0;
+    } else {
+        memcpy(gl->str, l->str, sizeof(gl->str));
+    }
+    gq->wr_idx = (gq->wr_idx + 1) % gq->lines_nr;
+    gq->block_used++;
+
+    if (!l->block) {
+        /* The lines of a block are passed together, like they were given to us */
+        _logger_seq_publish(&gq->wr_seq, gq->block_used);
+        gq->block_used = 0;
+        _logger_wakeup(_logger_waiting());
+    }
+}
+
+/* Formats the line in the output buffer, or passes it to the queue of the group */
+static inline void _logger_take_line(_logger_reader_t *r, logger_write_queue_t *wrq, logger_line_t *l)
+{
+    if (r->group) {
+        _logger_group_put(r->group, wrq, l);
+        return;
+    }
+    _logger_output_line(wrq, l);
+}
+
+/**
+ * The lines following l in its block were published with it: they are
+ * taken right after it, nothing from the other queues goes in between.
+ * Returns the last one, left to be freed by the next step like a single
+ * line.  In a group, they are passed to its queue, otherwise they are sent
+ * with a single write.
+ */
+static logger_line_t *_logger_take_block(_logger_reader_t *r, logger_write_queue_t *wrq, logger_line_t *l,
+                                            int *printed_nr)
+{
+    while (1) {
+        _logger_take_line(r, wrq, l);
+        (*printed_nr)++;
+        if (!l->block) {
+            break;
+        }
+        _logger_free_line(wrq, l);
+        l = _logger_get_next_line(wrq); // Published with the 1st one, always there
+    }
+    if (!r->group && _logger_output_flush() < 0) {
+        dbg_printf("<logger-thd-read> logger_output_flush(): %m\n");
+    }
+    return l;
+}
+
+/**
+ * Takes the line on top of the table, then the next ones of its queue as
+ * long as they are not newer than the lines of the other queues (and than
+ * the ones on the way, see _logger_is_in_order()).  A burst of a single
+ * thread then costs a format per line, without a merge step for each, and
+ * is written at once.  Each line is visited anyway to be formatted, so
+ * checking its time stamp (prefetched) is enough to find the end of the
+ * run.  Ends with fuse[0] on the next line to consider.
+ */
+static void _logger_take_run(_logger_reader_t *r, int *printed_nr)
+{
+    _logger_fuse_entry_t *fuse = r->fuse;
+    logger_write_queue_t *wrq = fuse[0].wrq;
+    logger_line_t *l = fuse[0].line;
+    unsigned long until = r->fuse_nr > 1 && fuse[1].ts < r->safe_ts ? fuse[1].ts : r->safe_ts;
+    int count = 0;
+
+    while (1) {
+        _logger_take_line(r, wrq, l);
+        (*printed_nr)++;
+        if (++count == wrq->lines_nr) {
+            fuse[0].line = l; // A lap at most (freed at the next step, like a single line)
+            break;
+        }
+        _logger_free_line(wrq, l);
+
+        unsigned int ahead = wrq->rd_idx + _LOGGER_RUN_PREFETCH;
+        if (ahead >= wrq->lines_nr) {
+            ahead -= wrq->lines_nr;
+        }
+        __builtin_prefetch(&wrq->lines[ahead].ts);
+        __builtin_prefetch(wrq->lines[ahead].str);
+
+        l = _logger_get_next_line(wrq);
+        if (!l || l->block || timespec_to_ns(l->ts) > until) {
+            /* End of the run: back in the table, not yet printed */
+            r->printed = false;
+            if (l) {
+                fuse[0].line = l;
+                fuse[0].ts = timespec_to_ns(l->ts);
+            } else {
+                fuse[0].ts = ~0;
+                r->empty_nr++;
+                r->safe_ts = 0; // Its next line may be on the way (see _logger_enqueue_next_lines())
+            }
+            _bubble_fuse_up(fuse, r->fuse_nr);
+            break;
+        }
+    }
+    /* (LOGGER_OPT_SPLICE: kept to fill whole pages, written once the reader is idle) */
+    if (!r->group && !_logger_output.ring && _logger_output_flush() < 0) {
+        dbg_printf("<logger-thd-read> logger_output_flush(): %m\n");
+    }
+}
+
+/* One merge step: prints (at most) one line, or a batch in the unordered mode */
+static _logger_step_t _logger_step(_logger_reader_t *r, int *printed_nr)
+{
+    int drained = 0;
+
+    if (!r->group && atomic_compare_exchange_strong(&logger.reader_moved, &(int){ 1 }, 0)) {
+        /* Moved to other CPU(s): take new pages, touched from there (NUMA local) */
+        dbg_printf("<logger-thd-read> Moved. Reallocating the merge state ...\n");
+        _logger_merge_reset(r);
+    }
+    if (!r->fuse_nr) {
+        r->reload = atomic_load(&logger.reload);
+        if (!logger.queues_nr) {
+            return _logger_step_empty(r);
+        }
+        if (!r->fuse) {
+            /* Fresh pages (not recycled by malloc): the 1st touch is ours, so on our NUMA node */
+            r->fuse_sz = logger.queues_max * sizeof(_logger_fuse_entry_t);
+            r->fuse = mmap(NULL, r->fuse_sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (r->fuse == MAP_FAILED) {
+                r->fuse = NULL;
+                return _LOGGER_STEP_EMPTY; // Can't merge. Retried at the next step ...
+            }
+        }
+        r->fuse_nr = r->empty_nr = _logger_init_lines_queue(r);
+        dbg_printf("<logger-thd-read> (Re)Loading... _logger_fuse_entry_t = %d x %lu bytes (%lu bytes total)\n",
+                        r->fuse_nr, sizeof(_logger_fuse_entry_t), r->fuse_nr * sizeof(_logger_fuse_entry_t));
+        if (!r->fuse_nr) {
+            return _logger_step_empty(r);
+        }
+        r->safe_ts = 0;
+        r->hold_since = 0;
+        r->printed = true;
+        r->unordered = !r->group && logger.unordered;
+    }
+    if (r->unordered) {
+        drained = _logger_drain_queues(r->fuse, r->fuse_nr);
+        *printed_nr += drained;
+    } else {
+        r->empty_nr = _logger_enqueue_next_lines(r->fuse, r->fuse_nr, r->empty_nr, r->printed, &r->safe_ts);
+        r->printed = true;
+    }
+    if (atomic_load(&logger.reload) != r->reload || (!r->group && logger.unordered) != r->unordered) {
+        /* New queue(s), or mode changed at runtime. Restart with a fresh fuse table. */
+        r->fuse_nr = 0;
+        return _LOGGER_STEP_BUSY;
+    }
+    if (r->unordered ? !drained : r->fuse[0].ts == ~0) {
+        return _logger_step_empty(r);
+    }
+    if (!r->group) {
+        logger.empty = false;
+    }
+
+    if (r->unordered) {
+        return _LOGGER_STEP_BUSY;
+    }
+    if (!_logger_is_in_order(r->fuse, r->fuse_nr, r->empty_nr, &r->safe_ts)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (!r->hold_since) {
+            r->hold_since = timespec_to_ns(now);
+        }
+        /**
+         * The reader too: a group gives up on its late lines, but keeps the
+         * watermark of the stalled writer.  Holding on it would stop the
+         * other groups as long as the writer is stopped.
+         */
+        if (timespec_to_ns(now) - r->hold_since < UTON(LOGGER_ORDER_HOLD_US)) {
+            dbg_printf("<logger-thd-read> Line on the way with an older time stamp. Waiting ...\n");
+            r->printed = false; // Keep this one for the next round
+            _logger_group_wmark(r);
+            return _LOGGER_STEP_HOLD;
+        }
+        if (_logger_empty_refilled(r->fuse, r->fuse_nr, r->empty_nr)) {
+            /* Published since we looked (preempted meanwhile, ...): merge it first, it's not late */
+            r->printed = false;
+            return _LOGGER_STEP_BUSY;
+        }
+        /* Still late. Don't wait anymore for it, until the order is back ... */
+        dbg_printf("<logger-thd-read> Late line still not there. Giving up ...\n");
+        if (logger.shared) {
+            _logger_reclaim_queues(r); // Maybe its process is dead ...
+        }
+    } else {
+        r->hold_since = 0;
+    }
+    if (r->group) {
+        _logger_group_wmark(r);
+    }
+    if (r->fuse[0].line->block) {
+        r->fuse[0].line = _logger_take_block(r, r->fuse[0].wrq, r->fuse[0].line, printed_nr);
+        return _LOGGER_STEP_BUSY;
+    }
+    /**
+     * If the output fails, the lines are lost but we must continue to empty
+     * the queues ... otherwise all the queues gets full and all the threads
+     * are stuck on it (this can happen if the disk is full, terminal stuck, ...)
+     */
+    _logger_take_run(r, printed_nr);
+    return _LOGGER_STEP_BUSY;
+}
+
+int logger_get_fd(void)
+{
+    if (!(logger.opts & LOGGER_OPT_EXTERNAL)) {
+        return errno = EINVAL, -1;
+    }
+    return logger.event_fd;
+}
+
+int logger_process(int budget)
+{
+    _logger_step_t step = _LOGGER_STEP_BUSY;
+    int printed = 0;
+    eventfd_t ev;
+
+    if (!(logger.opts & LOGGER_OPT_EXTERNAL)) {
+        return errno = EINVAL, -1;
+    }
+    if (pthread_mutex_trylock(&_logger_reader.mx)) {
+        return 0; // Another thread is at it
+    }
+    eventfd_read(logger.event_fd, &ev); // Consume the wake up(s). EAGAIN if none.
+
+    while (!budget || printed < budget) {
+        step = _logger_step(&_logger_reader, &printed);
+        if (step != _LOGGER_STEP_BUSY) {
+            _logger_output_flush_pending();
+        }
+        _logger_signal_flushers();
+        if (step == _LOGGER_STEP_BUSY) {
+            continue;
+        }
+        if (step == _LOGGER_STEP_HOLD) {
+            sched_yield(); // The late writer was maybe preempted: let it finish its line
+            break;
+        }
+        /* Empty: the writers will signal the fd. Double check for a line published just before */
+        _logger_reclaim_queues(&_logger_reader);
+        if (logger.opts & LOGGER_OPT_GZIP) {
+            _logger_gzip_handoff(); // Idle: what we have can go to the disk
+        }
+        atomic_store(_logger_waiting(), 1);
+        if (!_logger_has_lines(&_logger_reader)) {
+            break;
+        }
+        atomic_compare_exchange_strong(_logger_waiting(), &(int){ 1 }, 0);
+    }
+    if (step != _LOGGER_STEP_EMPTY) {
+        /* Not done (budget or late line): stay readable to be called again */
+        eventfd_write(logger.event_fd, 1);
+    }
+    pthread_mutex_unlock(&_logger_reader.mx);
+    return printed;
+}
+
+/* Merges until stopped: the reader, or a group */
+static void _logger_merge(_logger_reader_t *r)
+{
+    atomic_int *waiting = r->group ? &r->group->waiting : _logger_waiting();
+    int really_empty = 0;
+
+    while (1) {
+        int printed = 0;
+        _logger_step_t step = _logger_step(r, &printed);
+
+        if (!r->group) {
+            if (step != _LOGGER_STEP_BUSY) {
+                _logger_output_flush_pending();
+            }
+            _logger_signal_flushers();
+        }
+        switch (step) {
+        case _LOGGER_STEP_BUSY:
+            really_empty = 0;
+            continue;
+
+        case _LOGGER_STEP_HOLD:
+            really_empty = 0;
+            usleep(1);
+            continue;
+
+        case _LOGGER_STEP_EMPTY:
+            break;
+        }
+        if (r->group ? !r->group->running : !logger.running) {
+            /* We want to terminate when all the queues are empty ! */
+            break;
+        }
+        if (really_empty < 5) {
+            int wait = 1 << really_empty++;
+            dbg_printf("<logger-thd-read> Print queue empty. Double check in %d us ...\n", wait);
+            usleep(wait);
+            /**
+             * Double-check multiple times if the queue is really empty.
+             * This is avoid the writers to wakeup too frequently the reader in case of burst.
+             * Waking him up through the futex also takes time and the goal is to lower the
+             * time spent in logger_printf() as much as possible ...
+             */
+            continue;
+        }
+        really_empty = 0;
+        _logger_reclaim_queues(r);
+        if (!r->group && logger.opts & LOGGER_OPT_GZIP) {
+            _logger_gzip_handoff(); // Idle: what we have can go to the disk
+        }
+        dbg_printf("<logger-thd-read> Print queue REALLY empty ... Zzz\n");
+        if (_logger_sleep(r, waiting) < 0) {
+            dbg_printf("<logger-thd-read> ERROR: %m !\n");
+            break;
+        }
+    }
+}
+
+void *_thread_logger(void)
+{
+    dbg_printf("<logger-thd-read> Starting...\n");
+
+    if (_logger_apply_reader_sched() < 0) {
+        dbg_printf("<logger-thd-read> Can't apply the scheduling parameters: %m\n");
+    }
+    _logger_merge(&_logger_reader);
+
+    dbg_printf("<logger-thd-read> Exit\n");
+    return NULL;
+}
+
+void *_thread_group(void *group)
+{
+    _logger_reader_t r = { .group = group };
+
+    dbg_printf("<logger-thd-grp> Starting group %d ...\n", r.group->first / LOGGER_GROUP_QUEUES);
+    _logger_merge(&r);
+    _logger_merge_reset(&r);
     return NULL;
 }
 #endif
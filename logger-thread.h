@@ -25,6 +25,7 @@
 #define _LOGGER_THREAD_H
 
 #include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <linux/futex.h>
 #include <stdatomic.h>
 #include <unistd.h>
@@ -44,10 +45,11 @@ extern "C" {
 
 #define NTOM(v) ((v)/1000000)    /* nSec -> mSec */
 #define NTOU(v) ((v)/1000)       /* nSec -> XSec */
+#define UTON(v) ((v)*1000)       /* uSec -> nSec */
 
-#define futex_wait(addr, val)		_futex((addr), FUTEX_WAIT_PRIVATE, (val), NULL)
-#define futex_timed_wait(addr, val, ts)	_futex((addr), FUTEX_WAIT_PRIVATE, (val), (ts))
-#define futex_wake(addr, val)		_futex((addr), FUTEX_WAKE_PRIVATE, (val), NULL)
+#define futex_wait(addr, val)		_futex((addr), FUTEX_WAIT | logger.futex_private, (val), NULL)
+#define futex_timed_wait(addr, val, ts)	_futex((addr), FUTEX_WAIT | logger.futex_private, (val), (ts))
+#define futex_wake(addr, val)		_futex((addr), FUTEX_WAKE | logger.futex_private, (val), NULL)
 
 inline int __attribute__((always_inline)) _futex(atomic_int *uaddr, int futex_op, int val, struct timespec *tv)
 {
@@ -55,7 +57,161 @@ inline int __attribute__((always_inline)) _futex(atomic_int *uaddr, int futex_op
     return syscall(SYS_futex, uaddr, futex_op, val, tv);
 }
 
+static inline atomic_int *_logger_waiting(void)
+{
+    /* The writers of the other processes can't see logger.waiting ... */
+    return logger.shared ? &logger.shared->waiting : &logger.waiting;
+}
+
+/* Who merges the lines of the queue: its group, or the reader (also for the queues of the groups) */
+static inline atomic_int *_logger_waiting_of(const logger_write_queue_t *wrq)
+{
+    if (logger.groups && wrq && wrq->queue_idx >= 0) {
+        return &logger.groups[wrq->queue_idx / LOGGER_GROUP_QUEUES].waiting;
+    }
+    return _logger_waiting();
+}
+
+/* Wakes up the thread sleeping on waiting. 1 if it was, 0 if not */
+static inline int _logger_wakeup(atomic_int *waiting)
+{
+    /**
+     * The sleeper sets waiting then looks at the queues a last time (see
+     * _logger_sleep()).  With the fence, either it sees the line published
+     * before, or we see it sleeping.  Then a plain load: the flag is only
+     * written when it falls asleep, so its line stays shared in the caches
+     * of the writers and the CAS is only done to wake it up.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed)
+            && atomic_compare_exchange_strong(waiting, &(int){ 1 }, 0)) {
+        if (logger.opts & LOGGER_OPT_EXTERNAL) {
+            /* Makes the fd readable for the event loop */
+            if (eventfd_write(logger.event_fd, 1) < 0) {
+                return -1;
+            }
+            return 1;
+        }
+        if (futex_wake(waiting, 1) < 0) { /* (the only) 1 waiter to wakeup  */
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static inline atomic_int *_logger_flushed(void)
+{
+    return logger.shared ? &logger.shared->flushed : &logger.flushed;
+}
+
+static inline atomic_int *_logger_flushers(void)
+{
+    return logger.shared ? &logger.shared->flushers : &logger.flushers;
+}
+
+/* Single writer per sequence: incremented with a release, the lines counted are complete (or free) */
+static inline void _logger_seq_publish(atomic_ulong *seq, unsigned long n)
+{
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + n, memory_order_release);
+}
+
+/**
+ * True if the writer has no free line in the ring (limit: lines usable).
+ * The read sequence is only read again when the last one seen says it is
+ * full, so the cache line of the reader is not pulled at each line.
+ * Acquire: the reader is done with the lines it went past.
+ */
+static inline bool _logger_ring_full(atomic_ulong *wr_seq, atomic_ulong *rd_seq, unsigned long *rd_seq_seen,
+                                        unsigned long limit)
+{
+    unsigned long written = atomic_load_explicit(wr_seq, memory_order_relaxed);
+
+    if (written - *rd_seq_seen < limit) {
+        return false;
+    }
+    *rd_seq_seen = atomic_load_explicit(rd_seq, memory_order_acquire);
+    return written - *rd_seq_seen >= limit;
+}
+
+/**
+ * The owner of a queue: the pid of its process (0: free), and how many
+ * times it was claimed.  The claim sets both at once, so the reader never
+ * sees a queue taken with the pid of a previous owner (see
+ * _logger_reclaim_queues()).
+ */
+#define _LOGGER_OWNER_PID(owner)	((pid_t)((owner) & 0xffffffffUL))
+
+static inline bool _logger_queue_free(logger_write_queue_t *wrq)
+{
+    return !_LOGGER_OWNER_PID(atomic_load(&wrq->owner));
+}
+
+/* Takes the queue if it is still free */
+static inline bool _logger_claim_queue(logger_write_queue_t *wrq)
+{
+    unsigned long owner = atomic_load(&wrq->owner);
+
+    return !_LOGGER_OWNER_PID(owner)
+        && atomic_compare_exchange_strong(&wrq->owner, &owner, ((owner >> 32) + 1) << 32 | getpid());
+}
+
+/* Gives it back (the claims are kept) */
+static inline void _logger_free_queue(logger_write_queue_t *wrq)
+{
+    atomic_fetch_and(&wrq->owner, ~0xffffffffUL);
+}
+
+/* Lines published in the queue so far, overflow & signal lane included */
+static inline unsigned long _logger_queue_written(logger_write_queue_t *wrq)
+{
+    return atomic_load(&wrq->wr_seq) + atomic_load(&wrq->ovf_wr_seq) + atomic_load(&wrq->sig_wr_seq);
+}
+
+/* Lines taken by the reader so far, same (only late, never ahead) */
+static inline unsigned long _logger_queue_read(logger_write_queue_t *wrq)
+{
+    return atomic_load(&wrq->rd_seq) + atomic_load(&wrq->ovf_rd_seq) + atomic_load(&wrq->sig_rd_seq);
+}
+
+#define LOGGER_WMARK_NONE	0UL	/* No line being written */
+#define LOGGER_WMARK_PENDING	1UL	/* A line is being written but its time stamp is not yet known */
+
+inline void __attribute__((always_inline)) _logger_clock_fence(void)
+{
+    /**
+     * Ensure the time read just before is taken before the memory accesses
+     * done after.  On x86, rdtsc can be executed late (or the following
+     * loads early) and only lfence prevents this.
+     */
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_lfence();
+#endif
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
 extern void * _thread_logger(void);
+extern void * _thread_group(void *group);
+extern void _logger_reader_reset(void);
+extern int _logger_apply_reader_sched(void);
+extern int _logger_prerender_line(const logger_write_queue_t *wrq, logger_line_t *l, const char *msg);
+
+extern int _logger_gzip_init(void);
+extern void _logger_gzip_handoff(void);
+extern ssize_t _logger_gzip_writev(const struct iovec *iov, int iovcnt, unsigned long ms);
+extern int _logger_gzip_wait(const struct timespec *end);
+extern void _logger_gzip_deinit(void);
+
+extern int _logger_splice_init(void);
+extern void _logger_splice_deinit(void);
+
+extern int _logger_index_init(void);
+extern void _logger_index_deinit(void);
+extern void _logger_index_member(unsigned long ms, size_t size);
+
+extern int _logger_profile_init(void);
+extern void _logger_profile_drop(const char *file, const char *func, unsigned int line);
+extern void _logger_profile_deinit(void);
 
 #ifdef __cplusplus
 }
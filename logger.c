@@ -23,6 +23,9 @@
 
 #if defined(LOGGER_USE_THREAD)
 
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <stdatomic.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -50,6 +53,18 @@
 logger_t logger;
 
 static _Thread_local logger_write_queue_t *_own_wrq = NULL; /* Local thread variable */
+static _Thread_local unsigned long _own_gen;	/* _logger_gen when _own_wrq was assigned */
+static unsigned long _logger_gen;		/* Number of logger_init() so far */
+
+/* Escalation of the thread after an error (LOGGER_OPT_ESCALATE) */
+static _Thread_local struct {
+    logger_line_level_t	level;		/* Min. level while escalated (EMERG: not escalated) */
+    int			lines;		/* Lines left */
+    unsigned long	until;		/* End (ns, CLOCK_MONOTONIC_COARSE) */
+} _escalation;
+
+static pthread_key_t  _logger_key;	/* Queue of the thread, to release it when the thread exits */
+static pthread_once_t _logger_key_once = PTHREAD_ONCE_INIT;
 
 static void _logger_set_thread_name(logger_write_queue_t *wrq)
 {
@@ -61,15 +76,45 @@ static void _logger_set_thread_name(logger_write_queue_t *wrq)
     wrq->thread_name_len = strlen(wrq->thread_name);
 }
 
+static void _logger_set_queue_opts(logger_write_queue_t *wrq, logger_opts_t opts)
+{
+    if (logger.shared) {
+        /* The overflow is mapped by the writer. The reader of the other process can't see it. */
+        opts &= ~LOGGER_OPT_OVERFLOW;
+    }
+    if (opts & LOGGER_OPT_SIGNAL && !wrq->sig_lines) {
+        /* Kept once allocated.  Shared: in the shared memory, by logger_init() only */
+        if (logger.shared || !(wrq->sig_lines = calloc(LOGGER_SIGNAL_LINES, sizeof(logger_line_t)))) {
+            dbg_printf("<%s> No signal lane for queue %d. Option disabled !\n", wrq->thread_name, wrq->queue_idx);
+            opts &= ~LOGGER_OPT_SIGNAL;
+        }
+    }
+    wrq->opts = opts;
+    wrq->lines_reserved = 0;
+
+    if (opts & LOGGER_OPT_PRERENDER) {
+        logger.name_width_fixed = true; // See _logger_format_text()
+    }
+
+    if (opts & LOGGER_OPT_PRIORESERVE && wrq->lines_nr > 1) {
+        /* At least one line for the important ones, but never the whole queue ... */
+        int reserved = wrq->lines_nr * LOGGER_PRIO_RESERVE_PCT / 100;
+        wrq->lines_reserved = reserved < 1 ? 1 : reserved < wrq->lines_nr ? reserved : wrq->lines_nr - 1;
+    }
+}
+
 logger_write_queue_t *_logger_alloc_write_queue(int lines_max, logger_opts_t opts)
 {
     if (logger.queues_nr == logger.queues_max) {
         return errno = ENOBUFS, NULL;
     }
-    logger_write_queue_t *wrq = calloc(1, sizeof(logger_write_queue_t));
+    /* Aligned: its writer and reader sides are on their own cache lines */
+    logger_write_queue_t *wrq = aligned_alloc(LOGGER_CACHE_LINE_SZ, sizeof(logger_write_queue_t));
+    memset(wrq, 0, sizeof(logger_write_queue_t));
+    atomic_init(&wrq->owner, 1UL << 32 | getpid());
     wrq->lines = calloc(lines_max, sizeof(logger_line_t));
     wrq->lines_nr = lines_max;
-    wrq->opts = opts;
+    _logger_set_queue_opts(wrq, opts);
     _logger_set_thread_name(wrq);
 
     if (opts & LOGGER_OPT_PREALLOC) {
@@ -95,47 +140,242 @@ logger_write_queue_t *_logger_alloc_write_queue(int lines_max, logger_opts_t opt
     pthread_mutex_unlock(&logger.queues_mx);
 
     /* Let the logger thread take this change into account when he can ... */
-    atomic_compare_exchange_strong(&logger.reload, &(int){ 0 }, 1);
+    atomic_fetch_add(&logger.reload, 1);
     return wrq;
 }
 
+static void _logger_atfork_child(void)
+{
+    /**
+     * The thread who forked had maybe a queue.  It is the one of the parent
+     * process now.  The child will get its own at its first print.
+     */
+    _own_wrq = NULL;
+}
+
+static int _logger_init_shared(int queues_max, int lines_max, logger_opts_t opts)
+{
+    static bool atfork_done = false;
+    size_t queues_sz = queues_max * sizeof(logger_write_queue_t);
+    size_t lines_sz = lines_max * sizeof(logger_line_t);
+    size_t sig_sz = opts & LOGGER_OPT_SIGNAL ? LOGGER_SIGNAL_LINES * sizeof(logger_line_t) : 0;
+    size_t size = sizeof(logger_shared_t) + queues_sz + queues_max * (sizeof(logger_write_queue_t *) + lines_sz + sig_sz);
+
+    /**
+     * Everything is allocated here, at once, before the worker processes
+     * are forked.  So the queues (and the pointers on them) are at the same
+     * addresses in all the processes.  As the queues can't be allocated
+     * anymore after that, they are all created now (and free).
+     */
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    logger.shared = p;
+    logger.shared->size = size;
+
+    logger_write_queue_t *wrq = p + sizeof(logger_shared_t);
+    logger.queues = p + sizeof(logger_shared_t) + queues_sz;
+
+    char *lines = (char *)&logger.queues[queues_max];
+
+    for (int i=0 ; i<queues_max ; i++, wrq++, lines += lines_sz + sig_sz) {
+        wrq->lines = (logger_line_t *)lines;
+        wrq->lines_nr = lines_max;
+        wrq->sig_lines = sig_sz ? (logger_line_t *)(lines + lines_sz) : NULL; // (After its lines)
+        wrq->queue_idx = i;
+        wrq->opts = opts;
+        atomic_init(&wrq->owner, 0); // Free
+        logger.queues[i] = wrq;
+    }
+    logger.queues_nr = queues_max;
+
+    if (!atfork_done) {
+        pthread_atfork(NULL, NULL, _logger_atfork_child);
+        atfork_done = true;
+    }
+    return 0;
+}
+
+/* Starts a merger thread per LOGGER_GROUP_QUEUES queues */
+static int _logger_init_groups(void)
+{
+    int groups_nr = (logger.queues_max + LOGGER_GROUP_QUEUES - 1) / LOGGER_GROUP_QUEUES;
+
+    if (!(logger.groups = aligned_alloc(LOGGER_CACHE_LINE_SZ, groups_nr * sizeof(logger_group_t)))) {
+        return -1;
+    }
+    memset(logger.groups, 0, groups_nr * sizeof(logger_group_t));
+    for (int g=0; g<groups_nr; g++) {
+        logger_group_t *grp = &logger.groups[g];
+
+        if (!(grp->queue.lines = calloc(LOGGER_GROUP_LINES, sizeof(logger_line_t)))) {
+            return -1;
+        }
+        grp->queue.lines_nr = LOGGER_GROUP_LINES;
+        atomic_init(&grp->queue.owner, 1UL << 32 | getpid()); // Never free
+        grp->queue.queue_idx = -1 - g; // Not one of logger.queues
+        grp->queue.thread_name_len = snprintf(grp->queue.thread_name, sizeof(grp->queue.thread_name), "logger-grp%d", g);
+        grp->first = g * LOGGER_GROUP_QUEUES;
+        grp->running = true;
+
+        if ((errno = pthread_create(&grp->thread, NULL, _thread_group, grp))) {
+            free(grp->queue.lines);
+            return -1;
+        }
+        pthread_setname_np(grp->thread, grp->queue.thread_name);
+        logger.groups_nr++;
+    }
+    return 0;
+}
+
+/* The groups first: what they merged is then printed by the reader */
+static void _logger_stop_groups(void)
+{
+    for (int g=0; g<logger.groups_nr; g++) {
+        logger_group_t *grp = &logger.groups[g];
+
+        while (!atomic_load(&grp->waiting)) {
+            dbg_printf("Waiting for group %d ...\n", g);
+            usleep(100);
+        }
+        grp->running = false;
+        _logger_wakeup(&grp->waiting);
+        pthread_join(grp->thread, NULL);
+    }
+}
+
+static void _logger_release(void);
+
+/**
+ * Undoes a logger_init() failing half way (errno kept): the groups started
+ * are stopped, the rest released, and the logger is left not running, so
+ * the prints fail instead of filling a queue that nobody reads.
+ */
+static int _logger_init_failed(void)
+{
+    int err = errno;
+
+    _logger_stop_groups();
+    _logger_release();
+    errno = err;
+    return -1;
+}
+
 int logger_init(int queues_max, int lines_max, logger_line_level_t level_min, logger_opts_t opts)
 {
+    if (opts & LOGGER_OPT_GROUPS && opts & (LOGGER_OPT_SHARED | LOGGER_OPT_EXTERNAL)) {
+        return errno = EINVAL, -1; // The groups are threads of the reader process
+    }
     memset(&logger, 0, sizeof(logger_t));
 
     pthread_mutex_init(&logger.queues_mx, NULL);
 
-    logger.queues = calloc(queues_max, sizeof(logger_write_queue_t *));
+    logger.futex_private = FUTEX_PRIVATE_FLAG;
+
+    if (opts & LOGGER_OPT_SHARED) {
+        if (_logger_init_shared(queues_max, lines_max, opts) < 0) {
+            return -1;
+        }
+        logger.futex_private = 0;
+    } else if (!(logger.queues = calloc(queues_max, sizeof(logger_write_queue_t *)))) {
+        return -1;
+    }
     logger.queues_max = queues_max;
     logger.opts = opts;
     logger.theme = &logger_colors_default;
     logger.default_lines_nr = lines_max;
     logger.level_min = level_min;
+    logger.unordered = opts & LOGGER_OPT_UNORDERED;
+    logger.format = opts & LOGGER_OPT_JSON   ? LOGGER_FORMAT_JSON
+                  : opts & LOGGER_OPT_LOGFMT ? LOGGER_FORMAT_LOGFMT : LOGGER_FORMAT_TEXT;
+    logger.escalate_level = opts & LOGGER_OPT_ESCALATE ? LOGGER_ESCALATE_LEVEL : LOGGER_LEVEL_EMERG;
+    logger.escalate_ms = LOGGER_ESCALATE_MS;
+    logger.escalate_lines = LOGGER_ESCALATE_LINES;
+    /* The groups prerender the lines, the other processes don't see our width */
+    logger.name_width_fixed = opts & (LOGGER_OPT_PRERENDER | LOGGER_OPT_GROUPS | LOGGER_OPT_SHARED);
     logger.running = true;
+    logger.reader_pid = getpid();
 
     _own_wrq = NULL;
+    _logger_gen++; // The queues of a previous init are not released by their threads anymore
 
+    if (opts & LOGGER_OPT_GZIP && _logger_gzip_init() < 0) {
+        logger.opts &= ~LOGGER_OPT_GZIP; // Cleaned up by itself
+        return _logger_init_failed();
+    }
+    if (opts & LOGGER_OPT_PROFILE && _logger_profile_init() < 0) {
+        return _logger_init_failed();
+    }
+    if (opts & LOGGER_OPT_SPLICE && !(opts & LOGGER_OPT_GZIP) && _logger_splice_init() < 0) {
+        return _logger_init_failed();
+    }
+    if (opts & LOGGER_OPT_INDEX && _logger_index_init() < 0) {
+        return _logger_init_failed();
+    }
+    if (opts & LOGGER_OPT_EXTERNAL) {
+        /* The caller's event loop polls this one & calls logger_process() */
+        if ((logger.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            return _logger_init_failed();
+        }
+        atomic_store(_logger_waiting(), 1); // Nothing to print yet: the 1st line signals the fd
+        return 0;
+    }
+    if (opts & LOGGER_OPT_GROUPS && _logger_init_groups() < 0) {
+        return _logger_init_failed();
+    }
     /* Reader thread */
-    pthread_create(&logger.reader_thread, NULL, (void *)_thread_logger, NULL);
+    if ((errno = pthread_create(&logger.reader_thread, NULL, (void *)_thread_logger, NULL))) {
+        return _logger_init_failed();
+    }
     pthread_setname_np(logger.reader_thread, "logger-reader");
     return 0;
 }
 
 void logger_deinit(void)
 {
-    /* Sync with the logger & force him to double-check the queues */
-    while (!logger.waiting) {
-        dbg_printf("Waiting for logger ...\n");
-        usleep(100);
+    if (logger.reader_pid != getpid()) {
+        /* Worker process (LOGGER_OPT_SHARED). The reader is not ours ... */
+        logger_free_write_queue();
+        return;
+    }
+    if (logger.opts & LOGGER_OPT_EXTERNAL) {
+        /* No reader thread: print what's left from here */
+        logger.running = false;
+        while (logger_process(0) > 0 || !logger.empty) {
+            usleep(1);
+        }
+        close(logger.event_fd);
+    } else {
+        _logger_stop_groups();
+
+        /* Sync with the logger & force him to double-check the queues */
+        while (!atomic_load(_logger_waiting())) {
+            dbg_printf("Waiting for logger ...\n");
+            usleep(100);
+        }
+        logger.running = false;
+        atomic_store(_logger_waiting(), 0);
+        int r = futex_wake(_logger_waiting(), 1);
+        if (r <= 0) {
+            dbg_printf("Logger already woke up ?! (r=%d, %m)\n", r);
+        }
+        dbg_printf("Joining logger ...\n");
+        pthread_join(logger.reader_thread, NULL);
     }
-    logger.running = false;
-    atomic_store(&logger.waiting, 0);
-    int r = futex_wake(&logger.waiting, 1);
-    if (r <= 0) {
-        dbg_printf("Logger already woke up ?! (r=%d, %m)\n", r);
+    _logger_reader_reset();
+    _logger_release();
+}
+
+/* What logger_init() set up, once the reader (if any) is stopped */
+static void _logger_release(void)
+{
+    if (logger.opts & LOGGER_OPT_GZIP) {
+        _logger_gzip_deinit();
     }
-    dbg_printf("Joining logger ...\n");
-    pthread_join(logger.reader_thread, NULL);
+    _logger_splice_deinit();
+    _logger_index_deinit();
+    _logger_profile_deinit();
 #ifdef _DEBUG_LOGGER
     int total = 0;
     for (int i = 0; i < logger.queues_nr; i++) {
@@ -143,14 +383,89 @@ void logger_deinit(void)
     }
     dbg_printf("total memory allocated for %d queues = %d kb\n", logger.queues_nr, total/1024);
 #endif
+    if (logger.shared) {
+        munmap(logger.shared, logger.shared->size);
+        memset(&logger, 0, sizeof(logger_t));
+        return;
+    }
     for (int i=0 ; i<logger.queues_nr; i++) {
+        if (logger.queues[i]->ovf_lines) {
+            munmap(logger.queues[i]->ovf_lines, LOGGER_OVERFLOW_LINES * sizeof(logger_line_t));
+        }
+        free(logger.queues[i]->sig_lines);
         free(logger.queues[i]->lines);
         free(logger.queues[i]);
     }
+    for (int g=0 ; g<logger.groups_nr; g++) {
+        free(logger.groups[g].queue.lines);
+    }
+    free(logger.groups);
     free(logger.queues);
     memset(&logger, 0, sizeof(logger_t));
 }
 
+static inline int _logger_wakeup_reader_if_needed(const logger_write_queue_t *wrq);
+
+static void _logger_thread_exit(void *arg)
+{
+    logger_write_queue_t *wrq = arg;
+
+    if (!logger.running || _own_gen != _logger_gen) {
+        return; // From a previous logger_init() ...
+    }
+    /**
+     * Thread exiting without logger_free_write_queue() (plain pthread_create(),
+     * thread pools, ...).  Waiting for its lines to be printed here would
+     * slow down its exit: the reader frees the queue once it is drained, or
+     * a new thread takes it back before (see _logger_take_released_queue()).
+     */
+    dbg_printf("<%s> Exiting. Queue %d to be released\n", wrq->thread_name, wrq->queue_idx);
+    atomic_store(&wrq->released, 1);
+    atomic_fetch_add(&logger.released, 1);
+    _logger_wakeup_reader_if_needed(wrq);
+    _own_wrq = NULL;
+}
+
+static int _logger_flush(logger_write_queue_t *only, int timeout_ms);
+
+/**
+ * No queue left: the ones released by the exited threads of this process
+ * may not be freed by the reader yet.  One big enough is taken back once
+ * its lines are written (they are printed with the name of its thread).
+ * Both sides take it by clearing its released flag.
+ */
+static logger_write_queue_t *_logger_take_released_queue(int lines_max)
+{
+    for (int i=0; i<logger.queues_nr; i++) {
+        logger_write_queue_t *wrq = logger.queues[i];
+        int released = 1;
+
+        if (!atomic_load(&wrq->released) || wrq->lines_nr < lines_max
+                || _LOGGER_OWNER_PID(atomic_load(&wrq->owner)) != getpid()) {
+            continue;
+        }
+        if (_logger_flush(wrq, -1) < 0) {
+            return NULL;
+        }
+        if (!atomic_compare_exchange_strong(&wrq->released, &released, 0)) {
+            continue; // Freed by the reader meanwhile, or taken by another thread
+        }
+        int n = atomic_load(&logger.released);
+        while (n > 0 && !atomic_compare_exchange_weak(&logger.released, &n, n - 1));
+
+        /* A new claim (same process): see _logger_reclaim_queues() */
+        atomic_fetch_add(&wrq->owner, 1UL << 32);
+        wrq->block_nr = wrq->block_used = wrq->build_len = 0; // Left unfinished by its thread
+        return wrq;
+    }
+    return errno = ENOBUFS, NULL;
+}
+
+static void _logger_key_create(void)
+{
+    pthread_key_create(&_logger_key, _logger_thread_exit);
+}
+
 int logger_assign_write_queue(unsigned int lines_max, logger_opts_t opts)
 {
     if (_own_wrq) {
@@ -170,7 +485,7 @@ retry:
     last_lines_nr = INT_MAX;
     fwrq = NULL;
     for (int i=0; i < logger.queues_nr; i++) {
-        if (!atomic_load(&queue[i]->free)) {
+        if (!_logger_queue_free(queue[i])) {
             continue;
         }
         /* Find the best free queue ... */
@@ -181,202 +496,1185 @@ retry:
         }
     }
     if (fwrq) {
-        if (!atomic_compare_exchange_strong(&fwrq->free, &(int){ 1 }, 0)) {
+        if (!_logger_claim_queue(fwrq)) {
             /* Race condition, another thread took it right before us. Trying another one */
             dbg_printf("<?> Race condition when trying to reuse queue %d ! Retrying...\n", fwrq->queue_idx);
             goto retry;
         }
         _logger_set_thread_name(fwrq);
-        fwrq->opts = opts ?: logger.opts;
+        _logger_set_queue_opts(fwrq, opts ?: logger.opts);
+
+        /* Back in the reader's merge (the free queues are not) */
+        atomic_fetch_add(&logger.reload, 1);
 
         dbg_printf("<%s> Reusing queue %d: lines_max[%d] queue_nr[%d]\n",
                         fwrq->thread_name, fwrq->queue_idx, lines_max, fwrq->lines_nr);
     } else {
         /* No free queue that fits our needs... Adding a new one. */
         fwrq = _logger_alloc_write_queue(lines_max, opts ?: logger.opts);
-        if (!fwrq) {
+        if (fwrq) {
+            dbg_printf("<%s> New queue allocated: %d = %d x %lu bytes (%lu kb allocated)\n",
+                            fwrq->thread_name, fwrq->queue_idx, lines_max, sizeof(logger_line_t),
+                            (lines_max * sizeof(logger_line_t)) >> 10);
+        } else if (errno != ENOBUFS || !(fwrq = _logger_take_released_queue(lines_max))) {
             return -1;
+        } else {
+            _logger_set_thread_name(fwrq);
+            _logger_set_queue_opts(fwrq, opts ?: logger.opts);
+            dbg_printf("<%s> Taking back released queue %d\n", fwrq->thread_name, fwrq->queue_idx);
         }
-        dbg_printf("<%s> New queue allocated: %d = %d x %lu bytes (%lu kb allocated)\n",
-                        fwrq->thread_name, fwrq->queue_idx, lines_max, sizeof(logger_line_t),
-                        (lines_max * sizeof(logger_line_t)) >> 10);
     }
+    fwrq->task = NULL;
     _own_wrq = fwrq;
+    _own_gen = _logger_gen;
+
+    pthread_once(&_logger_key_once, _logger_key_create);
+    pthread_setspecific(_logger_key, fwrq);
     return 0;
 }
 
-static inline int _logger_wakeup_reader_if_needed(void)
+/* Wake-up lazy guy merging this queue (NULL: the reader), there is something to do ! */
+static inline int _logger_wakeup_reader_if_needed(const logger_write_queue_t *wrq)
 {
-    if (atomic_compare_exchange_strong(&logger.waiting, &(int){ 1 }, 0)) {
-        /* Wake-up lazy guy, there is something to do ! */
-        dbg_printf("<%s> Waking up the logger ...\n", _own_wrq->thread_name);
-        if (futex_wake(&logger.waiting, 1) < 0) { /* (the only) 1 waiter to wakeup  */
-            return -1;
-        }
-        return 1;
+    int ret = _logger_wakeup(_logger_waiting_of(wrq));
+
+    if (ret > 0) {
+        dbg_printf("<%s> Woke up the logger ...\n", wrq ? wrq->thread_name : "?");
     }
-    return 0;
+    return ret;
 }
 
-int logger_free_write_queue(void)
+static inline unsigned long _logger_usable_lines(const logger_write_queue_t *wrq, logger_line_level_t level)
 {
-    if (!_own_wrq) {
-        /* No queue allocated. Nothing to do ... */
-        return 0;
+    /**
+     * When the queue is almost full, the remaining lines are kept for the
+     * important levels only.  The less important ones have to wait (or are
+     * dropped) like if the queue was full.  The read sequence seen can only
+     * be late, so the worst case is to see less free lines than there
+     * really is ...
+     */
+    if (wrq->lines_reserved && level > LOGGER_PRIO_LEVEL_MAX) {
+        return wrq->lines_nr - wrq->lines_reserved;
     }
-    dbg_printf("<%s> Freeing queue %d ...\n", _own_wrq->thread_name, _own_wrq->queue_idx);
-    while (_own_wrq->rd_seq != _own_wrq->wr_seq) {
-        if (_logger_wakeup_reader_if_needed() < 0) {
-            return -1;
+    return wrq->lines_nr;
+}
+
+static logger_line_t *_logger_get_overflow_line(logger_write_queue_t *wrq, int count)
+{
+    if (!wrq->ovf_lines) {
+        /**
+         * Only the virtual space is reserved here.  The pages are really
+         * allocated by the kernel when they are touched the 1st time, so
+         * only the size of the biggest burst is consumed ...
+         */
+        void *p = mmap(NULL, LOGGER_OVERFLOW_LINES * sizeof(logger_line_t), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            dbg_printf("<%s> Overflow mapping failed (%m). Option disabled !\n", wrq->thread_name);
+            wrq->opts &= ~LOGGER_OPT_OVERFLOW;
+            return NULL;
         }
-        /* Wait for the queue to be empty before leaving ... */
-        usleep(100);
+        wrq->ovf_lines = p;
     }
-    atomic_store(&_own_wrq->free, 1);
-    _own_wrq = NULL;
-    return 0;
+    if (_logger_ring_full(&wrq->ovf_wr_seq, &wrq->ovf_rd_seq, &wrq->ovf_rd_seq_seen, LOGGER_OVERFLOW_LINES - count + 1)) {
+        /* The overflow is full too ... */
+        return NULL;
+    }
+    wrq->ovf_used = true;
+    return &wrq->ovf_lines[wrq->ovf_wr_idx];
 }
 
-typedef struct {
-    void       *(*start_routine)(void *);
-    void         *arg;
-    int           max_lines;
-    logger_opts_t opts;
-    char          thread_name[LOGGER_MAX_THREAD_NAME_SZ];
-} _thread_params;
-
-static void _logger_pthread_wrapper(_thread_params *params)
+/* 1st of count free lines (following each other in the same ring) */
+static inline logger_line_t *_logger_get_free_line(logger_write_queue_t *wrq, logger_line_level_t level, int count)
 {
-    pthread_cleanup_push((void *)free, (void *)params);
+    if (wrq->ovf_used) {
+        if (atomic_load_explicit(&wrq->ovf_rd_seq, memory_order_acquire)
+                != atomic_load_explicit(&wrq->ovf_wr_seq, memory_order_relaxed)) {
+            /**
+             * Once something was spilled, everything must follow the same
+             * way until the reader caught up.  Otherwise the lines of this
+             * thread would not be in order anymore.
+             */
+            return _logger_get_overflow_line(wrq, count);
+        }
+        wrq->ovf_used = false; /* Everything was printed. Back to the normal queue. */
+    }
+    unsigned long usable = _logger_usable_lines(wrq, level);
 
-    pthread_setname_np(pthread_self(), params->thread_name);
-    /**
-     * The name of the thread is fixed at allocation time so, the
-     * pthread_setname_np() call must occur before the assignation bellow.
-     * If there is no name specified, thread_id is used instead.
-     */
-    if (!(params->opts & LOGGER_OPT_NOQUEUE)
-    &&  logger_assign_write_queue(params->max_lines, params->opts) < 0) {
-        /**
-         * Oops!  If this happen, it could mean the limit of queues to
-         * allocate is too low !!
-         */
-        fprintf(stderr, "<%s> No space to allocate a new queue of %d lines !\n",
-                        params->thread_name, params->max_lines);
-        abort();
+    /* (A block bigger than the queue can only go in the overflow lines) */
+    if (count <= usable && !_logger_ring_full(&wrq->wr_seq, &wrq->rd_seq, &wrq->rd_seq_seen, usable - count + 1)) {
+        return &wrq->lines[wrq->wr_idx];
     }
+    if (wrq->opts & LOGGER_OPT_OVERFLOW) {
+        return _logger_get_overflow_line(wrq, count);
+    }
+    return NULL;
+}
+
+static inline void _logger_get_time(logger_write_queue_t *wrq, struct timespec *ts)
+{
     /**
-     * Must be called when the thread don't need it anymore.  Otherwise it
-     * will stay allocated for an unexistant thread for ever !
-     *
-     * Note also that if this thread never call logger_printf, you should not
-     * use this wrapper but better use the native pthread_create(3) instead
-     * as all this is useless and reserve a log queue for nothing ...
-     *
-     * If you think logger_printf() will be called in rare cases (or from
-     * sub-functions you don't manage), you can use the option
-     * LOGGER_OPT_NOQUEUE to don't reserve a queue at fork time.  The
-     * counterpart of using this is that the queue is reserved at print time
-     * using the default options and the allocation errors are detected at
-     * that time only.
+     * The line is announced before the time is taken.  So when the reader
+     * sees nothing here, it knows that the next line of this queue will
+     * have a time stamp after the moment it looked.  Otherwise it waits
+     * for it (see _logger_is_in_order()), even if the line has to wait for
+     * a free place in the queue first.  No fence: the reader allows it
+     * LOGGER_ORDER_SLACK_US to be seen, instead of a full barrier per line.
      */
-    pthread_cleanup_push((void *)logger_free_write_queue, NULL);
-
-    /* Let run the main thread function */
-    pthread_exit(params->start_routine(params->arg));
+    atomic_store_explicit(&wrq->wr_wmark, LOGGER_WMARK_PENDING, memory_order_relaxed);
+    atomic_signal_fence(memory_order_seq_cst); // (Stored before the clock is read, for the compiler)
+    clock_gettime(CLOCK_REALTIME, ts);
+    atomic_store_explicit(&wrq->wr_wmark, timespec_to_ns(*ts), memory_order_relaxed);
+}
 
-    /* I know this sounds weird but it's the way it is... pushs needs pops ! */
-    pthread_cleanup_pop(true);
-    pthread_cleanup_pop(true);
+static inline void _logger_clear_wmark(logger_write_queue_t *wrq)
+{
+    /* Released after the line is published: if the reader sees it cleared, it sees the line */
+    atomic_store_explicit(&wrq->wr_wmark, LOGGER_WMARK_NONE, memory_order_release);
 }
 
-int logger_pthread_create(const char *thread_name, unsigned int max_lines, logger_opts_t opts,
-    pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg)
+static inline void _logger_line_set_task(const logger_write_queue_t *wrq, logger_line_t *l)
 {
-    _thread_params *params = malloc(sizeof(_thread_params));
+    if (wrq->task) {
+        strncpy(l->task, wrq->task, sizeof(l->task) - 1); // Truncated like the thread names
+        l->task[sizeof(l->task) - 1] = 0;
+    } else {
+        l->task[0] = 0;
+    }
+}
 
-    if (!params) {
-        return -1;
+/* Passes the count lines filled to the reader, with a single release */
+static inline void _logger_publish_lines(logger_write_queue_t *wrq, int count)
+{
+    if (wrq->ovf_used) {
+        wrq->ovf_wr_idx = (wrq->ovf_wr_idx + count) % LOGGER_OVERFLOW_LINES;
+        _logger_seq_publish(&wrq->ovf_wr_seq, count);
+    } else {
+        wrq->wr_idx = (wrq->wr_idx + count) % wrq->lines_nr;
+        _logger_seq_publish(&wrq->wr_seq, count);
     }
-    strncpy(params->thread_name, thread_name, sizeof(params->thread_name)-1);
-    params->thread_name[sizeof(params->thread_name)-1] = 0;
-    params->max_lines = max_lines;
-    params->opts = opts;
-    params->start_routine = start_routine;
-    params->arg = arg;
+}
 
-    return pthread_create(thread, attr, (void *)_logger_pthread_wrapper, (void *)params);
+static inline void _logger_publish_line(logger_write_queue_t *wrq, logger_line_t *l)
+{
+    _logger_line_set_task(wrq, l);
+    _logger_publish_lines(wrq, 1);
 }
 
-int logger_printf(logger_line_level_t level,
-        const char *src,
-        const char *func,
-        unsigned int line,
-        const char *format, ...)
+static logger_line_t *_logger_wait_free_line(logger_write_queue_t *wrq, logger_line_level_t level, int count,
+                                                const struct timespec *ts)
 {
-    if (!logger.running) {
-        return errno = ENOTCONN, -1;
-    }
-    if (level > logger.level_min) {
-        return 0;
-    }
-    if (!_own_wrq && logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
-        return -1;
-    }
-    va_list ap;
-    int index;
     logger_line_t *l;
-    struct timespec ts;
-
-    /* Save the time this function get called */
-    clock_gettime(CLOCK_REALTIME, &ts);
 
 reindex:
-    index = _own_wrq->wr_seq % _own_wrq->lines_nr;
-    l = &_own_wrq->lines[index];
-
-    while (l->ready) {
-        dbg_printf("<%s> Queue full ... (%d)\n", _own_wrq->thread_name, _own_wrq->queue_idx);
+    while (!(l = _logger_get_free_line(wrq, level, count))) {
+        dbg_printf("<%s> Queue full ... (%d)\n", wrq->thread_name, wrq->queue_idx);
 
-        int ret = _logger_wakeup_reader_if_needed();
+        if (count > _logger_usable_lines(wrq, level) && !(wrq->opts & LOGGER_OPT_OVERFLOW)) {
+            return errno = ENOBUFS, NULL; // Never fits (the overflow mapping failed meanwhile)
+        }
+        if (logger.opts & LOGGER_OPT_EXTERNAL && !(wrq->opts & LOGGER_OPT_NONBLOCK)
+                && getpid() == logger.reader_pid && logger_process(wrq->lines_nr) > 0) {
+            /* No reader thread. This one is maybe the event loop itself: empty the queues from here */
+            continue;
+        }
+        int ret = _logger_wakeup_reader_if_needed(wrq);
         if (ret > 0) {
             usleep(1); // Let a chance to the logger to empty at least a cell before giving up...
             continue;
         }
         else if (ret < 0) {
-            return -1;
+            return NULL;
         }
-        if (_own_wrq->opts & LOGGER_OPT_NONBLOCK) {
-            _own_wrq->lost++;
-            dbg_printf("<%s> Line dropped (%lu %s) !\n", _own_wrq->thread_name, _own_wrq->lost,
-                    _own_wrq->opts & LOGGER_OPT_PRINTLOST ? "since last print" : "so far");
-            return errno = EAGAIN, -1;
+        if (wrq->opts & LOGGER_OPT_NONBLOCK) {
+            wrq->lost++;
+            dbg_printf("<%s> Line dropped (%lu %s) !\n", wrq->thread_name, wrq->lost,
+                    wrq->opts & LOGGER_OPT_PRINTLOST ? "since last print" : "so far");
+            return errno = EAGAIN, NULL;
         }
         usleep(50);
     }
-    if (_own_wrq->lost && _own_wrq->opts & LOGGER_OPT_PRINTLOST) {
-        int lost = _own_wrq->lost;
-        _own_wrq->lost_total += lost;
-        _own_wrq->lost = 0;
+    if (wrq->lost && wrq->opts & LOGGER_OPT_PRINTLOST) {
+        unsigned long lost = wrq->lost;
+        wrq->lost_total += lost;
+        wrq->lost = 0;
 
-        logger_printf(LOGGER_LEVEL_OOPS, __FILE__, __FUNCTION__, __LINE__,
-            "Lost %d log line(s) (%d so far) !", lost, _own_wrq->lost_total);
+        /* Same time stamp as the line who noticed it, to stay in order */
+        if (ts) {
+            l->ts = *ts;
+        } else {
+            _logger_get_time(wrq, &l->ts);
+        }
+        l->level = LOGGER_LEVEL_OOPS;
+        l->file = __FILE__;
+        l->func = __FUNCTION__;
+        l->line = __LINE__;
+        l->render = NULL;
+        l->fields = 0;
+        l->prerendered = 0;
+        l->block = 0;
+        l->attach.buf = NULL;
+        snprintf(l->str, sizeof(l->str), "Lost %lu log line(s) (%lu so far) !", lost, wrq->lost_total);
+        _logger_publish_line(wrq, l);
 
+        if (!ts) {
+            _logger_clear_wmark(wrq);
+        }
         goto reindex;
     }
-    va_start(ap, format);
+    return l;
+}
 
-    l->ts = ts;
-    l->level = level;
-    l->file = src;
-    l->func = func;
-    l->line = line;
-    vsnprintf(l->str, sizeof(l->str), format, ap);
+/**
+ * Waits for the reader to go past the lines published so far in the queues
+ * (only = NULL: all of them).  Its steps are counted (logger.flushed) while
+ * somebody waits here: a step started after the last line was taken ends
+ * with everything written.  With the groups, the lines are first waited in
+ * their queues, then in the ones of the groups.
+ */
+static int _logger_flush(logger_write_queue_t *only, int timeout_ms)
+{
+    int queues_nr = only ? 1 : logger.queues_nr;
+    struct timespec now, end;
+    bool reached = false, grouped = !logger.groups;
+    int pending = 0, gen, reached_gen = 0, ret = 0;
+
+    if (!logger.running) {
+        return errno = EINVAL, -1;
+    }
+    if (!queues_nr) {
+        return 0;
+    }
+    logger_write_queue_t *queues[queues_nr + logger.groups_nr];
+    unsigned long seq[queues_nr + logger.groups_nr];
+
+    for (int i=0; i<queues_nr; i++) {
+        logger_write_queue_t *wrq = only ?: logger.queues[i];
+
+        if (only || !_logger_queue_free(wrq)) {
+            queues[pending] = wrq;
+            seq[pending++] = _logger_queue_written(wrq);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec  += timeout_ms / 1000;
+    end.tv_nsec += MTON(timeout_ms % 1000);
+    if (end.tv_nsec >= STON(1)) {
+        end.tv_sec++;
+        end.tv_nsec -= STON(1);
+    }
+    atomic_fetch_add(_logger_flushers(), 1);
+
+    while (1) {
+        gen = atomic_load(_logger_flushed());
+
+        for (int i=0; i<pending; ) {
+            if ((long)(_logger_queue_read(queues[i]) - seq[i]) >= 0) {
+                pending--;
+                queues[i] = queues[pending];
+                seq[i] = seq[pending];
+            } else {
+                i++;
+            }
+        }
+        if (!pending && !grouped) {
+            /* Merged by the groups. Now in their queues ... */
+            for (int g=0; g<logger.groups_nr; g++) {
+                if (!only || only->queue_idx / LOGGER_GROUP_QUEUES == g) {
+                    queues[pending] = &logger.groups[g].queue;
+                    seq[pending++] = _logger_queue_written(&logger.groups[g].queue);
+                }
+            }
+            grouped = true;
+            continue;
+        }
+        if (!pending) {
+            if (reached ? gen != reached_gen : atomic_load(_logger_waiting())) {
+                break; // A whole step after the last one (or sleeping after it): written
+            }
+            if (!reached) {
+                reached = true;
+                reached_gen = gen;
+            }
+        }
+        if (logger.opts & LOGGER_OPT_EXTERNAL) {
+            logger_process(0); // Maybe from the event loop itself ...
+        } else if (_logger_wakeup_reader_if_needed(NULL) < 0) {
+            ret = -1;
+            break;
+        }
+        for (int i=0; logger.groups && !grouped && i<pending; i++) {
+            _logger_wakeup_reader_if_needed(queues[i]); // Their group
+        }
+        long left = UTON(LOGGER_FLUSH_RETRY_US);
+
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((left = (long)(timespec_to_ns(end) - timespec_to_ns(now))) <= 0) {
+                errno = ETIMEDOUT;
+                ret = -1;
+                break;
+            }
+            if (left > UTON(LOGGER_FLUSH_RETRY_US)) {
+                left = UTON(LOGGER_FLUSH_RETRY_US);
+            }
+        }
+        /* Not only woken up by the reader: it can fall asleep just before our wake up */
+        struct timespec ts = { .tv_nsec = left };
+        if (futex_timed_wait(_logger_flushed(), gen, &ts) < 0 && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+            ret = -1;
+            break;
+        }
+    }
+    atomic_fetch_sub(_logger_flushers(), 1);
+
+    if (ret == 0 && logger.opts & LOGGER_OPT_GZIP && getpid() == logger.reader_pid) {
+        /* Handed to the compression (see _logger_signal_flushers()), not yet written ... */
+        ret = _logger_gzip_wait(timeout_ms >= 0 ? &end : NULL);
+    }
+    return ret;
+}
+
+/* Written is not enough for a crash report: a file is also synced (EINVAL: not a file) */
+static inline int _logger_sync(int ret)
+{
+    if (ret == 0 && fdatasync(1) < 0 && errno != EINVAL && errno != EROFS) {
+        return -1;
+    }
+    return ret;
+}
+
+int logger_flush(int timeout_ms)
+{
+    return _logger_sync(_logger_flush(NULL, timeout_ms));
+}
+
+int logger_flush_self(int timeout_ms)
+{
+    if (!_own_wrq) {
+        return 0; // Nothing logged by this thread
+    }
+    return _logger_sync(_logger_flush(_own_wrq, timeout_ms));
+}
+
+int logger_free_write_queue(void)
+{
+    if (!_own_wrq) {
+        /* No queue allocated. Nothing to do ... */
+        return 0;
+    }
+    dbg_printf("<%s> Freeing queue %d ...\n", _own_wrq->thread_name, _own_wrq->queue_idx);
+    /* Wait for the queue to be empty before leaving ... */
+    if (_logger_flush(_own_wrq, -1) < 0) {
+        return -1;
+    }
+    pthread_setspecific(_logger_key, NULL);
+    _logger_free_queue(_own_wrq);
+    atomic_fetch_add(&logger.reload, 1);
+    _own_wrq = NULL;
+    return 0;
+}
+
+static int _logger_apply_sched(pthread_t thread, pid_t tid, const logger_sched_t *s)
+{
+    int r;
+
+    if (s->flags & LOGGER_SCHED_CPUS && (r = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &s->cpus))) {
+        return errno = r, -1;
+    }
+    if (s->flags & LOGGER_SCHED_POLICY
+    &&  (r = pthread_setschedparam(thread, s->policy, &(struct sched_param){ .sched_priority = s->priority }))) {
+        return errno = r, -1;
+    }
+    if (s->flags & LOGGER_SCHED_NICE && setpriority(PRIO_PROCESS, tid, s->nice) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Kept out of logger_t: it can be set before logger_init() */
+static logger_sched_t _logger_reader_sched;
+
+int _logger_apply_reader_sched(void)
+{
+    /* Called by the reader itself, before it allocates anything */
+    logger.reader_tid = syscall(SYS_gettid);
+    return _logger_apply_sched(pthread_self(), logger.reader_tid, &_logger_reader_sched);
+}
+
+int logger_set_reader_sched(const logger_sched_t *sched)
+{
+    _logger_reader_sched = *sched;
+
+    if (!logger.running || !logger.reader_tid) {
+        return 0; // Used when the reader starts
+    }
+    if (logger.opts & LOGGER_OPT_EXTERNAL) {
+        return errno = ENOTSUP, -1; // The reader is the caller's event loop
+    }
+    if (_logger_apply_sched(logger.reader_thread, logger.reader_tid, sched) < 0) {
+        return -1;
+    }
+    if (sched->flags & LOGGER_SCHED_LOCAL) {
+        atomic_store(&logger.reader_moved, 1);
+    }
+    return 0;
+}
+
+typedef struct {
+    void       *(*start_routine)(void *);
+    void         *arg;
+    int           max_lines;
+    logger_opts_t opts;
+    logger_sched_t sched;
+    char          thread_name[LOGGER_MAX_THREAD_NAME_SZ];
+} _thread_params;
+
+static void _logger_pthread_wrapper(_thread_params *params)
+{
+    pthread_cleanup_push((void *)free, (void *)params);
+
+    pthread_setname_np(pthread_self(), params->thread_name);
+
+    /* Placed 1st, so its queue is allocated (touched) from its CPU(s) */
+    if (params->sched.flags && _logger_apply_sched(pthread_self(), syscall(SYS_gettid), &params->sched) < 0) {
+        fprintf(stderr, "<%s> Can't apply the scheduling parameters: %m\n", params->thread_name);
+    }
+    /**
+     * The name of the thread is fixed at allocation time so, the
+     * pthread_setname_np() call must occur before the assignation bellow.
+     * If there is no name specified, thread_id is used instead.
+     */
+    if (!(params->opts & LOGGER_OPT_NOQUEUE)
+    &&  logger_assign_write_queue(params->max_lines, params->opts) < 0) {
+        /**
+         * Oops!  If this happen, it could mean the limit of queues to
+         * allocate is too low !!
+         */
+        fprintf(stderr, "<%s> No space to allocate a new queue of %d lines !\n",
+                        params->thread_name, params->max_lines);
+        abort();
+    }
+    /**
+     * Must be called when the thread don't need it anymore.  Otherwise it
+     * will stay allocated for an unexistant thread for ever !
+     *
+     * Note also that if this thread never call logger_printf, you should not
+     * use this wrapper but better use the native pthread_create(3) instead
+     * as all this is useless and reserve a log queue for nothing ...
+     *
+     * If you think logger_printf() will be called in rare cases (or from
+     * sub-functions you don't manage), you can use the option
+     * LOGGER_OPT_NOQUEUE to don't reserve a queue at fork time.  The
+     * counterpart of using this is that the queue is reserved at print time
+     * using the default options and the allocation errors are detected at
+     * that time only.
+     */
+    pthread_cleanup_push((void *)logger_free_write_queue, NULL);
+
+    /* Let run the main thread function */
+    pthread_exit(params->start_routine(params->arg));
+
+    /* I know this sounds weird but it's the way it is... pushs needs pops ! */
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+}
+
+int logger_pthread_create_sched(const char *thread_name, unsigned int max_lines, logger_opts_t opts,
+    const logger_sched_t *sched, pthread_t *thread, const pthread_attr_t *attr,
+    void *(*start_routine)(void *), void *arg)
+{
+    _thread_params *params = calloc(1, sizeof(_thread_params));
+
+    if (!params) {
+        return -1;
+    }
+    strncpy(params->thread_name, thread_name, sizeof(params->thread_name)-1);
+    params->thread_name[sizeof(params->thread_name)-1] = 0;
+    params->max_lines = max_lines;
+    params->opts = opts;
+    params->start_routine = start_routine;
+    params->arg = arg;
+    if (sched) {
+        params->sched = *sched;
+    }
+    return pthread_create(thread, attr, (void *)_logger_pthread_wrapper, (void *)params);
+}
+
+int logger_pthread_create(const char *thread_name, unsigned int max_lines, logger_opts_t opts,
+    pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg)
+{
+    return logger_pthread_create_sched(thread_name, max_lines, opts, NULL, thread, attr, start_routine, arg);
+}
+
+static void _logger_escalate(void)
+{
+    struct timespec now;
+
+    /* Each error starts it again */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    _escalation.level = logger.escalate_level;
+    _escalation.lines = logger.escalate_lines > 0 ? logger.escalate_lines : INT_MAX;
+    _escalation.until = logger.escalate_ms > 0 ? timespec_to_ns(now) + MTON((unsigned long)logger.escalate_ms) : ~0UL;
+}
+
+static bool _logger_still_escalated(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (_escalation.lines-- > 0 && timespec_to_ns(now) < _escalation.until) {
+        return true;
+    }
+    _escalation.level = LOGGER_LEVEL_EMERG; // Back to the normal level
+    return false;
+}
+
+/**
+ * True if a line of this level is not printed.  For the lines printed,
+ * only the errors cost a bit more (they escalate the thread).  For the
+ * others, only a compare with the thread's level, unless it is escalated.
+ */
+static inline bool _logger_filtered(logger_line_level_t level)
+{
+    if (__builtin_expect(level <= logger.level_min, 1)) {
+        if (level <= LOGGER_ESCALATE_TRIGGER && logger.escalate_level > logger.level_min) {
+            _logger_escalate();
+        }
+        return false;
+    }
+    return level > _escalation.level || !_logger_still_escalated();
+}
+
+/* Returns 1 if the line is filtered (not queued) */
+static int _logger_vprintf(logger_write_queue_t *wrq,
+        logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const logger_attach_t *attach,
+        const char *format, va_list ap)
+{
+    if (!logger.running) {
+        return errno = ENOTCONN, -1;
+    }
+    if (_logger_filtered(level)) {
+        return 1;
+    }
+    if (!wrq) {
+        if (logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
+            return -1;
+        }
+        wrq = _own_wrq;
+    }
+    logger_line_t *l;
+    struct timespec ts;
+
+    /* Save the time this function get called */
+    _logger_get_time(wrq, &ts);
+
+    if (!(l = _logger_wait_free_line(wrq, level, 1, &ts))) {
+        _logger_clear_wmark(wrq);
+        if (errno == EAGAIN) {
+            _logger_profile_drop(src, func, line);
+        }
+        return -1;
+    }
+    l->ts = ts;
+    l->level = level;
+    l->file = src;
+    l->func = func;
+    l->line = line;
+    l->render = NULL;
+    l->fields = 0;
+    l->prerendered = 0;
+    l->block = 0;
+    l->attach.buf = NULL;
+    if (attach) {
+        l->attach = *attach; // Only the reference: the reader prints it from there
+    }
+    if (wrq->opts & LOGGER_OPT_PRERENDER && logger.format == LOGGER_FORMAT_TEXT) {
+        /* The formatting cost is ours, not the one of the (single) reader */
+        char msg[LOGGER_LINE_SZ];
+
+        vsnprintf(msg, sizeof(msg), format, ap);
+        _logger_line_set_task(wrq, l);
+        _logger_prerender_line(wrq, l, msg);
+    } else {
+        vsnprintf(l->str, sizeof(l->str), format, ap);
+    }
+
+    _logger_publish_line(wrq, l);
+    _logger_clear_wmark(wrq);
+
+    if (_logger_wakeup_reader_if_needed(wrq) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int logger_printf(logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const char *format, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = _logger_vprintf(_own_wrq, level, src, func, line, NULL, format, ap);
+    va_end(ap);
+
+    return ret < 0 ? -1 : 0;
+}
+
+logger_ctx_t *logger_get_ctx(void)
+{
+    if (!_own_wrq && logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
+        return NULL;
+    }
+    return _own_wrq;
+}
+
+int logger_set_task(const char *task)
+{
+    if (!_own_wrq && logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
+        return -1;
+    }
+    _own_wrq->task = task;
+    return 0;
+}
+
+int logger_printf_ctx(logger_ctx_t *ctx,
+        logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const char *format, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = _logger_vprintf(ctx, level, src, func, line, NULL, format, ap);
+    va_end(ap);
+
+    return ret < 0 ? -1 : 0;
+}
+
+int logger_printf_attach(logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const logger_attach_t *attach,
+        const char *format, ...)
+{
+    va_list ap;
+    int ret;
+
+    if (logger.shared && getpid() != logger.reader_pid) {
+        /* The logger thread can't see the memory of this process */
+        errno = ENOTSUP, ret = -1;
+    } else {
+        va_start(ap, format);
+        ret = _logger_vprintf(_own_wrq, level, src, func, line, attach->buf ? attach : NULL, format, ap);
+        va_end(ap);
+
+        if (ret == 0 && attach->buf) {
+            return 0; // Released by the logger thread
+        }
+    }
+    if (attach->release) {
+        attach->release(attach->buf, attach->len, attach->arg);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+logger_line_t *logger_reserve_line(logger_line_level_t level)
+{
+    if (!logger.running) {
+        return errno = ENOTCONN, NULL;
+    }
+    if (_logger_filtered(level)) {
+        return errno = 0, NULL;
+    }
+    if (!_own_wrq && logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
+        return NULL;
+    }
+    logger_line_t *l = _logger_wait_free_line(_own_wrq, level, 1, NULL);
+
+    if (l) {
+        l->render = NULL;
+        l->fields = 0;
+        l->prerendered = 0;
+        l->block = 0;
+        l->attach.buf = NULL;
+    }
+    return l;
+}
+
+int logger_publish_line(logger_line_t *l, logger_line_level_t level, const char *src, const char *func, unsigned int line)
+{
+    struct timespec ts;
+
+    /* The line is filled already. So, the time stamp is the time it is published. */
+    _logger_get_time(_own_wrq, &ts);
+
+    l->ts = ts;
+    l->level = level;
+    l->file = src;
+    l->func = func;
+    l->line = line;
+
+    _logger_publish_line(_own_wrq, l);
+    _logger_clear_wmark(_own_wrq);
+
+    if (_logger_wakeup_reader_if_needed(_own_wrq) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+logger_line_t *logger_line_begin(logger_line_level_t level)
+{
+    logger_line_t *l = logger_reserve_line(level);
+
+    if (l) {
+        l->level = level;
+        l->str[0] = 0;
+        _own_wrq->build_len = 0;
+    }
+    return l;
+}
+
+int logger_line_append(logger_line_t *l, const char *str)
+{
+    if (!l) {
+        return 0;
+    }
+    int *len = &_own_wrq->build_len;
+    size_t n = strlen(str), room = sizeof(l->str) - 1 - *len;
+
+    if (n > room) {
+        memcpy(l->str + *len, str, room);
+        *len += room;
+        l->str[*len] = 0;
+        return errno = ENOSPC, -1;
+    }
+    memcpy(l->str + *len, str, n + 1);
+    *len += n;
+    return 0;
+}
+
+int logger_line_appendf(logger_line_t *l, const char *format, ...)
+{
+    if (!l) {
+        return 0;
+    }
+    int *len = &_own_wrq->build_len;
+    size_t room = sizeof(l->str) - *len;
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(l->str + *len, room, format, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        l->str[*len] = 0;
+        return -1;
+    }
+    if (n >= room) {
+        *len += room - 1;
+        return errno = ENOSPC, -1;
+    }
+    *len += n;
+    return 0;
+}
+
+int logger_line_commit(logger_line_t *l, const char *src, const char *func, unsigned int line)
+{
+    if (!l) {
+        return 0;
+    }
+    logger_write_queue_t *wrq = _own_wrq;
+    struct timespec ts;
+
+    /* Like logger_publish_line(): the time stamp is the time it is complete */
+    _logger_get_time(wrq, &ts);
+
+    l->ts = ts;
+    l->file = src;
+    l->func = func;
+    l->line = line;
+    _logger_line_set_task(wrq, l);
+
+    if (wrq->opts & LOGGER_OPT_PRERENDER && logger.format == LOGGER_FORMAT_TEXT) {
+        char msg[LOGGER_LINE_SZ];
+
+        memcpy(msg, l->str, wrq->build_len + 1);
+        _logger_prerender_line(wrq, l, msg);
+    }
+    _logger_publish_lines(wrq, 1);
+    _logger_clear_wmark(wrq);
+
+    if (_logger_wakeup_reader_if_needed(wrq) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* i-th line of the block being filled (the lines follow each other from the write index) */
+static inline logger_line_t *_logger_block_line(const logger_write_queue_t *wrq, int i)
+{
+    if (wrq->ovf_used) {
+        return &wrq->ovf_lines[(wrq->ovf_wr_idx + i) % LOGGER_OVERFLOW_LINES];
+    }
+    return &wrq->lines[(wrq->wr_idx + i) % wrq->lines_nr];
+}
+
+int logger_reserve_block(logger_line_level_t level, int count)
+{
+    if (!logger.running) {
+        return errno = ENOTCONN, -1;
+    }
+    if (!_own_wrq && logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
+        return -1;
+    }
+    logger_write_queue_t *wrq = _own_wrq;
+    int max = wrq->opts & LOGGER_OPT_OVERFLOW ? LOGGER_OVERFLOW_LINES : _logger_usable_lines(wrq, level);
+
+    /**
+     * The whole block must fit in the queue (and in the one of its group),
+     * otherwise we would wait for ever.  As it can go in the overflow
+     * lines, the queue itself can be smaller.
+     */
+    if (count < 1 || count > max || count > USHRT_MAX + 1 || (logger.groups && count > LOGGER_GROUP_LINES)) {
+        return errno = EINVAL, -1;
+    }
+    if (wrq->block_nr) {
+        return errno = EBUSY, -1; // Not published yet
+    }
+    if (!_logger_wait_free_line(wrq, level, count, NULL)) {
+        return -1;
+    }
+    wrq->block_nr = count;
+    wrq->block_used = 0;
+    return 0;
+}
+
+int logger_block_printf(logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const char *format, ...)
+{
+    logger_write_queue_t *wrq = _own_wrq;
+
+    if (!wrq || !wrq->block_nr) {
+        return errno = EINVAL, -1; // No block reserved
+    }
+    if (_logger_filtered(level)) {
+        return 0;
+    }
+    if (wrq->block_used == wrq->block_nr) {
+        return errno = ENOSPC, -1;
+    }
+    logger_line_t *l = _logger_block_line(wrq, wrq->block_used++);
+    va_list ap;
+
+    l->level = level;
+    l->file = src;
+    l->func = func;
+    l->line = line;
+    l->render = NULL;
+    l->fields = 0;
+    l->prerendered = 0;
+    l->attach.buf = NULL;
+
+    va_start(ap, format);
+    vsnprintf(l->str, sizeof(l->str), format, ap);
+    va_end(ap);
+    return 0;
+}
+
+int logger_publish_block(void)
+{
+    logger_write_queue_t *wrq = _own_wrq;
+    struct timespec ts;
+    int count;
+
+    if (!wrq || !wrq->block_nr) {
+        return errno = EINVAL, -1;
+    }
+    if (!(count = wrq->block_used)) {
+        wrq->block_nr = 0;
+        return 0; // Everything was filtered
+    }
+    /* One time stamp for all: nothing from the other threads can be printed in the middle */
+    _logger_get_time(wrq, &ts);
+
+    for (int i=0; i<count; i++) {
+        logger_line_t *l = _logger_block_line(wrq, i);
+
+        l->ts = ts;
+        l->block = count - 1 - i;
+        _logger_line_set_task(wrq, l);
+
+        if (wrq->opts & LOGGER_OPT_PRERENDER && logger.format == LOGGER_FORMAT_TEXT) {
+            char msg[LOGGER_LINE_SZ];
+
+            memcpy(msg, l->str, sizeof(msg));
+            _logger_prerender_line(wrq, l, msg);
+        }
+    }
+    _logger_publish_lines(wrq, count);
+    _logger_clear_wmark(wrq);
+    wrq->block_nr = wrq->block_used = 0;
+
+    if (_logger_wakeup_reader_if_needed(wrq) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Appends the number v in base (10 or 16) at p, without going further than end */
+static char *_logger_signal_number(char *p, const char *end, unsigned long long v, bool neg, int base, bool upper)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[24];
+    int n = 0;
+
+    do {
+        tmp[n++] = digits[v % base];
+        v /= base;
+    } while (v);
+    if (neg && p < end) {
+        *p++ = '-';
+    }
+    while (n && p < end) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+/* Subset of vsnprintf(), async-signal-safe (no locale, no malloc, no stdio). Returns the length */
+static int _logger_signal_format(char *buf, size_t size, const char *fmt, va_list ap)
+{
+    char *p = buf, *end = buf + size - 1;
+
+    while (*fmt && p < end) {
+        if (*fmt != '%') {
+            *p++ = *fmt++;
+            continue;
+        }
+        int lng = 0;
+        fmt++;
+        /* Flags, width & precision: ignored, but their arguments must be skipped */
+        while (*fmt && strchr("-+ #0123456789.*", *fmt)) {
+            if (*fmt++ == '*') {
+                (void)va_arg(ap, int);
+            }
+        }
+        while (*fmt == 'l' || *fmt == 'h' || *fmt == 'z') {
+            lng += *fmt == 'l' ? 1 : *fmt == 'z' ? 2 : 0;
+            fmt++;
+        }
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            long long v = lng >= 2 ? va_arg(ap, long long) : lng ? va_arg(ap, long) : va_arg(ap, int);
+            p = _logger_signal_number(p, end, v < 0 ? -(unsigned long long)v : v, v < 0, 10, false);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X': {
+            unsigned long long v = lng >= 2 ? va_arg(ap, unsigned long long)
+                                 : lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            p = _logger_signal_number(p, end, v, false, *fmt == 'u' ? 10 : 16, *fmt == 'X');
+            break;
+        }
+        case 'p':
+            *p++ = '0';
+            if (p < end) {
+                *p++ = 'x';
+            }
+            p = _logger_signal_number(p, end, (unsigned long)va_arg(ap, void *), false, 16, false);
+            break;
+        case 'c':
+            *p++ = (char)va_arg(ap, int);
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            for (s = s ?: "(null)"; *s && p < end; ) {
+                *p++ = *s++;
+            }
+            break;
+        }
+        case '%':
+            *p++ = '%';
+            break;
+        default:
+            continue; // Unknown (or end): printed as is
+        }
+        fmt++;
+    }
+    *p = 0;
+    return p - buf;
+}
+
+int logger_signal_printf(logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const char *format, ...)
+{
+    logger_write_queue_t *wrq = _own_wrq; // Never allocated from here
+    int errno_save = errno, ret = 0;
+    va_list ap;
+
+    if (!logger.running || level > logger.level_min) {
+        return 0;
+    }
+    if (!wrq) {
+        return errno = ENOENT, -1;
+    }
+    if (!wrq->sig_lines) {
+        return errno = ENOTSUP, -1; // Without LOGGER_OPT_SIGNAL
+    }
+    if (atomic_exchange(&wrq->sig_busy, 1)) {
+        return errno = EAGAIN, -1; // Interrupted another handler printing
+    }
+    if (atomic_load_explicit(&wrq->sig_wr_seq, memory_order_relaxed)
+            - atomic_load_explicit(&wrq->sig_rd_seq, memory_order_acquire) >= LOGGER_SIGNAL_LINES) {
+        atomic_store(&wrq->sig_busy, 0);
+        _logger_profile_drop(src, func, line); // (Lock free)
+        return errno = EAGAIN, -1;
+    }
+    /* The thread maybe was in the middle of a line: nothing of the queue is touched but the lane */
+    logger_line_t *l = &wrq->sig_lines[wrq->sig_wr_idx];
+
+    clock_gettime(CLOCK_REALTIME, &l->ts);
+    l->level = level;
+    l->file = src;
+    l->func = func;
+    l->line = line;
+    l->render = NULL;
+    l->fields = 0;
+    l->prerendered = 0;
+    l->block = 0;
+    l->attach.buf = NULL;
+    _logger_line_set_task(wrq, l);
+
+    va_start(ap, format);
+    _logger_signal_format(l->str, sizeof(l->str), format, ap);
+    va_end(ap);
+
+    wrq->sig_wr_idx = (wrq->sig_wr_idx + 1) % LOGGER_SIGNAL_LINES;
+    _logger_seq_publish(&wrq->sig_wr_seq, 1);
+    atomic_store(&wrq->sig_busy, 0);
+
+    if (_logger_wakeup_reader_if_needed(wrq) < 0) {
+        ret = -1;
+    }
+    errno = errno_save;
+    return ret;
+}
+
+static unsigned short _logger_encode_fields(char *str, size_t size, const char *msg, const logger_field_t *f)
+{
+    /**
+     * Layout: msg\0 then, per field: type (1 byte), key (pointer), value
+     * (8 bytes, 1 for a bool, or 16 bits length + chars for a string).
+     * Nothing is escaped here, the reader does it when printing.
+     */
+    size_t len = strnlen(msg, size / 2 - 1); // Leave (at least) half of the line for the fields
+    char *p = str, *end = str + size - 1;    // Keep 1 byte for the end mark
+
+    memcpy(p, msg, len);
+    p[len] = 0;
+    p += len + 1;
+
+    unsigned short fields = p - str;
+
+    for (; f->type != LOGGER_FIELD_END; f++) {
+        const size_t hdr = 1 + sizeof(f->key);
+        size_t vsz = f->type == LOGGER_FIELD_BOOL ? 1 : f->type == LOGGER_FIELD_STR ? sizeof(unsigned short) : 8;
+
+        if (end - p < hdr + vsz) {
+            break; // Line full. The next fields are lost
+        }
+        *p = f->type;
+        memcpy(p + 1, &f->key, sizeof(f->key));
+        p += hdr;
+
+        switch (f->type) {
+        case LOGGER_FIELD_BOOL:
+            *p = f->b;
+            break;
+        case LOGGER_FIELD_STR: {
+            const char *s = f->s ? f->s : "(null)";
+            unsigned short slen = strnlen(s, end - p - vsz);
+            memcpy(p, &slen, vsz);
+            memcpy(p + vsz, s, slen);
+            p += slen;
+            break;
+        }
+        default: // Same size for all the numbers
+            memcpy(p, &f->i, vsz);
+            break;
+        }
+        p += vsz;
+    }
+    *p = LOGGER_FIELD_END;
+
+    return fields;
+}
+
+int logger_log_fields(logger_line_level_t level,
+        const char *src,
+        const char *func,
+        unsigned int line,
+        const char *msg,
+        const logger_field_t *fields)
+{
+    if (!logger.running) {
+        return errno = ENOTCONN, -1;
+    }
+    if (_logger_filtered(level)) {
+        return 0;
+    }
+    if (!_own_wrq && logger_assign_write_queue(0, LOGGER_OPT_NONE) < 0) {
+        return -1;
+    }
+    logger_line_t *l;
+    struct timespec ts;
+
+    _logger_get_time(_own_wrq, &ts);
+
+    if (!(l = _logger_wait_free_line(_own_wrq, level, 1, &ts))) {
+        _logger_clear_wmark(_own_wrq);
+        if (errno == EAGAIN) {
+            _logger_profile_drop(src, func, line);
+        }
+        return -1;
+    }
+    l->ts = ts;
+    l->level = level;
+    l->file = src;
+    l->func = func;
+    l->line = line;
+    l->render = NULL;
+    l->prerendered = 0;
+    l->block = 0;
+    l->attach.buf = NULL;
+    l->fields = _logger_encode_fields(l->str, sizeof(l->str), msg, fields);
 
-    l->ready = true;
-    _own_wrq->wr_seq++;
+    _logger_publish_line(_own_wrq, l);
+    _logger_clear_wmark(_own_wrq);
 
-    if (_logger_wakeup_reader_if_needed() < 0) {
+    if (_logger_wakeup_reader_if_needed(_own_wrq) < 0) {
         return -1;
     }
     return 0;
@@ -24,9 +24,19 @@
 #ifndef _LOGGER_H
 #define _LOGGER_H
 
+#include <sys/types.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef __cplusplus
+#include <atomic>   /* <stdatomic.h> is C only (before C++23) */
+typedef std::atomic_int   atomic_int;
+typedef std::atomic_ulong atomic_ulong;
+#else
 #include <stdatomic.h>
+#endif
 #include <time.h>
 
 #ifdef __cplusplus
@@ -39,6 +49,50 @@ extern "C" {
 
 #define LOGGER_MAX_SOURCE_LEN		50	/* Maximum length of "file:src:line" sub string */
 
+#define LOGGER_PRIO_RESERVE_PCT		10	/* % of the queue kept for the important levels (LOGGER_OPT_PRIORESERVE) */
+#define LOGGER_PRIO_LEVEL_MAX		LOGGER_LEVEL_ERROR /* Least important level allowed to use the reserve */
+
+#define LOGGER_OVERFLOW_LINES		32768	/* Lines of the overflow queue (LOGGER_OPT_OVERFLOW). Mapped on demand */
+#define LOGGER_SIGNAL_LINES		8	/* Lines of the signal lane of a queue (LOGGER_OPT_SIGNAL) */
+
+#define LOGGER_OUTPUT_BUF_SZ		(64 * 1024) /* Output buffer of the reader when the lines are batched */
+
+#define LOGGER_ESCALATE_TRIGGER		LOGGER_LEVEL_ERROR /* Least important level escalating its thread (LOGGER_OPT_ESCALATE) */
+#define LOGGER_ESCALATE_LEVEL		LOGGER_LEVEL_DEBUG /* Level of an escalated thread (logger.escalate_level) */
+#define LOGGER_ESCALATE_MS		2000	/* How long it stays escalated (logger.escalate_ms, <= 0: no limit) */
+#define LOGGER_ESCALATE_LINES		200	/* Lines it can print above the min. level meanwhile (<= 0: no limit) */
+
+#define LOGGER_ORDER_HOLD_US		1000	/* Max time the reader waits for a late line before printing newer ones */
+#define LOGGER_ORDER_SLACK_US		1	/* Time for a line announced by a writer (no fence) to be seen by the reader */
+
+#define LOGGER_RECLAIM_INTERVAL		1	/* Seconds between 2 checks of the dead processes (LOGGER_OPT_SHARED) */
+
+#define LOGGER_FLUSH_RETRY_US		1000	/* logger_flush(): wakes the reader again if nothing happened meanwhile */
+
+#define LOGGER_GROUP_QUEUES		64	/* Queues merged by each group thread (LOGGER_OPT_GROUPS) */
+#define LOGGER_GROUP_LINES		1024	/* Lines of the (ordered) queue of a group */
+
+#define LOGGER_GZIP_CHUNK_SZ		(1024 * 1024) /* Output compressed by gzip members of this size (LOGGER_OPT_GZIP) */
+#define LOGGER_GZIP_CHUNKS		4	/* Chunks the reader can fill while the previous ones are compressed */
+#define LOGGER_GZIP_LEVEL		6	/* zlib compression level */
+
+#define LOGGER_PIPE_SZ			(1024 * 1024) /* Capacity asked for the pipe of the output (LOGGER_OPT_SPLICE) */
+
+#define LOGGER_INDEX_LINES		1024	/* Lines between 2 entries of the index of the output file (LOGGER_OPT_INDEX) */
+#define LOGGER_INDEX_BYTES		(256 * 1024) /* Or bytes, whichever comes first */
+#define LOGGER_INDEX_SUFFIX		".idx"	/* Index of "out.log" in "out.log.idx" */
+
+#define LOGGER_PROFILE_SITES		1024	/* Call sites counted (LOGGER_OPT_PROFILE). Power of 2 */
+#define LOGGER_PROFILE_SAMPLE		64	/* The time in queue is measured on 1 line out of this. Power of 2 */
+
+#define LOGGER_CACHE_LINE_SZ		64	/* The reader and writer sides of a queue never share one */
+
+#ifdef __cplusplus
+#define _LOGGER_CACHE_ALIGNED	alignas(LOGGER_CACHE_LINE_SZ)
+#else
+#define _LOGGER_CACHE_ALIGNED	_Alignas(LOGGER_CACHE_LINE_SZ)
+#endif
+
 typedef enum {
     /* Levels compatibles with syslog */
     LOGGER_LEVEL_EMERG		= 0,			/* Emergecy: System is unusable. Complete restart/checks must be done.	*/
@@ -68,16 +122,107 @@ typedef enum {
     LOGGER_OPT_PRINTLOST = 2,	/* Print lost lines soon as there is some free space again */
     LOGGER_OPT_PREALLOC  = 4,	/* Force the kernel to really allocate the bloc (to bypass the copy-on-write mechanism) */
     LOGGER_OPT_NOQUEUE   = 8,	/* Start the thread with no queue. Allocate it on the 1st logger_printf() call instead. */
+    LOGGER_OPT_PRIORESERVE = 16,/* Keep LOGGER_PRIO_RESERVE_PCT % of the queue for the levels <= LOGGER_PRIO_LEVEL_MAX */
+    LOGGER_OPT_OVERFLOW  = 32,	/* Spill the lines in an overflow queue instead of waiting/dropping when the queue is full */
+    LOGGER_OPT_UNORDERED = 64,	/* logger_init() only: drain the queues by batches, without the chronological merge */
+    LOGGER_OPT_SHARED    = 128,	/* logger_init() only: queues in shared memory, usable by the forked processes */
+    LOGGER_OPT_JSON      = 256,	/* logger_init() only: print the lines as JSON objects (see logger.format) */
+    LOGGER_OPT_LOGFMT    = 512,	/* logger_init() only: print the lines as logfmt key=value pairs */
+    LOGGER_OPT_EXTERNAL  = 1024,/* logger_init() only: no reader thread. Call logger_process() when logger_get_fd() is readable */
+    LOGGER_OPT_PRERENDER = 2048,/* The writer formats the whole text line (prefix included): the reader only copies it */
+    LOGGER_OPT_GROUPS    = 4096,/* logger_init() only: a thread per LOGGER_GROUP_QUEUES queues merges them for the reader */
+    LOGGER_OPT_GZIP      = 8192,/* logger_init() only: the output is gzip compressed by its own thread (LOGGER_USE_ZLIB) */
+    LOGGER_OPT_SPLICE    = 16384,/* logger_init() only: if stdout is a pipe, the batches are given to it with vmsplice() */
+    LOGGER_OPT_ESCALATE  = 32768,/* logger_init() only: after an error, its thread prints more details for a while */
+    LOGGER_OPT_PROFILE   = 65536,/* logger_init() only: count the lines, bytes & drops per call site (logger_dump_profile()) */
+    LOGGER_OPT_INDEX     = 131072,/* logger_init() only: if stdout is a file, index it by time (see logger-seek) */
+    LOGGER_OPT_SIGNAL    = 262144,/* Give the queue a signal lane (logger_signal_printf()). Shared: logger_init() only */
 } logger_opts_t;
 
+/* Renders the binary data of a line (see logger_reserve_line()) as text. Returns the length */
+typedef int (*logger_render_t)(char *buf, size_t size, const char *data);
+
+/* Placement & scheduling of the reader or a writer thread (see logger_set_reader_sched()) */
+typedef enum {
+    LOGGER_SCHED_CPUS   = 1,	/* Set the CPU affinity */
+    LOGGER_SCHED_POLICY = 2,	/* Set the scheduling policy & priority */
+    LOGGER_SCHED_NICE   = 4,	/* Set the nice value */
+    LOGGER_SCHED_LOCAL  = 8,	/* Reader only: (re)allocate its merge state once placed (on its NUMA node) */
+} logger_sched_flags_t;
+
+typedef struct {
+    logger_sched_flags_t flags;		/* What to set */
+    cpu_set_t		cpus;		/* CPUs allowed (an isolated core for example) */
+    int			policy;		/* SCHED_OTHER, SCHED_FIFO, SCHED_RR, SCHED_BATCH, SCHED_IDLE */
+    int			priority;	/* Static priority (SCHED_FIFO & SCHED_RR, 0 otherwise) */
+    int			nice;		/* Nice value (SCHED_OTHER & SCHED_BATCH) */
+} logger_sched_t;
+
+/* Large buffers attached to a line by reference (see logger_printf_attach()) */
+typedef enum {
+    LOGGER_ATTACH_RAW = 0,	/* Printed as is (written directly from the buffer in the text format) */
+    LOGGER_ATTACH_HEX,		/* Hex dump */
+} logger_attach_mode_t;
+
+/* Called by the logger thread when the attached buffer is not needed anymore */
+typedef void (*logger_release_t)(const void *buf, size_t len, void *arg);
+
+typedef struct {
+    const void		*buf;		/* Attached buffer: not copied, must stay valid until released */
+    size_t		len;		/* Its length */
+    logger_attach_mode_t mode;		/* How to print it */
+    logger_release_t	release;	/* Called once printed (NULL: nothing to do) */
+    void		*arg;		/* Argument of release() */
+} logger_attach_t;
+
+typedef enum {
+    LOGGER_FORMAT_TEXT = 0,	/* Colored text lines (default) */
+    LOGGER_FORMAT_JSON,		/* One JSON object per line */
+    LOGGER_FORMAT_LOGFMT,	/* logfmt: key=value pairs separated by spaces */
+} logger_format_t;
+
+/* Structured fields (see LOG_FIELDS()). Stored in binary in the line, escaped by the reader only */
+typedef enum {
+    LOGGER_FIELD_END = 0,	/* End of the fields list */
+    LOGGER_FIELD_INT,		/* long long */
+    LOGGER_FIELD_UINT,		/* unsigned long long */
+    LOGGER_FIELD_DOUBLE,	/* double */
+    LOGGER_FIELD_BOOL,		/* bool */
+    LOGGER_FIELD_STR,		/* Copied in the line (truncated if needed) */
+} logger_field_type_t;
+
+typedef struct {
+    const char		*key;		/* Static string: only the pointer is kept (like for the file/function) */
+    logger_field_type_t	type;		/* Type of the value */
+    union {
+        long long		i;
+        unsigned long long	u;
+        double			d;
+        bool			b;
+        const char		*s;
+    };
+} logger_field_t;
+
+#define LOGGER_INT(k, v)	((logger_field_t){ .key = (k), .type = LOGGER_FIELD_INT,    .i = (v) })
+#define LOGGER_UINT(k, v)	((logger_field_t){ .key = (k), .type = LOGGER_FIELD_UINT,   .u = (v) })
+#define LOGGER_DOUBLE(k, v)	((logger_field_t){ .key = (k), .type = LOGGER_FIELD_DOUBLE, .d = (v) })
+#define LOGGER_BOOL(k, v)	((logger_field_t){ .key = (k), .type = LOGGER_FIELD_BOOL,   .b = (v) })
+#define LOGGER_STR(k, v)	((logger_field_t){ .key = (k), .type = LOGGER_FIELD_STR,    .s = (v) })
+
 /* Definition of a log line */
 typedef struct {
-    bool		ready;               /* Line ready to be printed */
     struct timespec	ts;                  /* Timestamp (key to order on) */
     logger_line_level_t level;               /* Level of this line */
     const char *	file;		     /* File who generated the log */
     const char *	func;		     /* Function */
     unsigned int	line;		     /* Line */
+    logger_render_t	render;		     /* Called by the reader to get the text from str. NULL: str is the text */
+    unsigned short	fields;		     /* Offset of the binary fields in str (0: none) */
+    unsigned short	prerendered;	     /* Length of the whole line made by the writer in str (0: no) */
+    unsigned short	block;		     /* Lines following this one in its block (see logger_reserve_block()) */
+    int			from;		     /* Queue it was written in, when merged by a group (LOGGER_OPT_GROUPS) */
+    logger_attach_t	attach;		     /* Attached buffer (attach.buf = NULL: none) */
+    char		task[LOGGER_MAX_THREAD_NAME_SZ]; /* Logical task (fiber, coroutine, ...) who printed it ("": none) */
     char		str[LOGGER_LINE_SZ]; /* Line buffer */
 } logger_line_t;
 
@@ -85,19 +230,65 @@ typedef struct {
 typedef struct {
     logger_line_t	*lines;			/* Lines buffer */
     int			lines_nr;		/* Maximum number of buffered lines for this thread */
+    int			lines_reserved;		/* Lines usable by the important levels only (LOGGER_OPT_PRIORESERVE) */
     int			queue_idx;		/* Index of the queue */
     logger_opts_t	opts;			/* Options for this queue. Set to default if not precised */
-    unsigned int	rd_idx;			/* Actual read index */
-    unsigned long	rd_seq;			/* Read sequence */
-    unsigned long	wr_seq;			/* Write sequence */
-    unsigned long	lost_total;		/* Total number of lost records so far */
-    unsigned long	lost;			/* Number of lost records since last printed */
-    atomic_int		free;			/* True (1) if this queue is not used */
+    logger_line_t	*ovf_lines;		/* Overflow lines (LOGGER_OPT_OVERFLOW). Mapped at the 1st use */
+    logger_line_t	*sig_lines;		/* Signal lane (LOGGER_OPT_SIGNAL), written by the signal handlers of the thread only */
+    atomic_ulong	owner;			/* Claims so far << 32 | process of its thread (0: free), see _logger_claim_queue() */
+    atomic_int		released;		/* True (1) if its thread exited without freeing it: freed once drained (or taken back) */
     pthread_t		thread;			/* Thread owning this queue */
     char		thread_name[LOGGER_MAX_THREAD_NAME_SZ]; /* Thread name */
     int			thread_name_len;	/* Length of the thread name */
+
+    /* Writer side: only written by the thread of the queue */
+    _LOGGER_CACHE_ALIGNED
+    atomic_ulong	wr_seq;			/* Lines published in lines[] (release: they are complete) */
+    atomic_ulong	ovf_wr_seq;		/* Lines published in ovf_lines[] */
+    atomic_ulong	sig_wr_seq;		/* Lines published in sig_lines[] (by a signal handler) */
+    atomic_ulong	wr_wmark;		/* Time stamp (ns) of the line being written (0: none, 1: not known yet) */
+    unsigned long	rd_seq_seen;		/* Last rd_seq read: read again only when the queue looks full */
+    unsigned long	ovf_rd_seq_seen;	/* Same for ovf_rd_seq */
+    unsigned int	wr_idx;			/* Actual write index */
+    unsigned int	ovf_wr_idx;		/* Overflow write index */
+    bool		ovf_used;		/* True while the writer spills in the overflow lines */
+    unsigned int	sig_wr_idx;		/* Signal lane write index */
+    atomic_int		sig_busy;		/* A handler is writing in the lane (nested signals are dropped) */
+    int			block_nr;		/* Lines reserved by logger_reserve_block() (0: no block) */
+    int			block_used;		/* Lines of the block filled so far */
+    int			build_len;		/* Length of the text of the line being built (logger_line_begin()) */
+    const char		*task;			/* Logical task running on this thread (NULL: none) */
+    unsigned long	lost_total;		/* Total number of lost records so far */
+    unsigned long	lost;			/* Number of lost records since last printed */
+
+    /* Reader side: only written by the thread merging the queue */
+    _LOGGER_CACHE_ALIGNED
+    atomic_ulong	rd_seq;			/* Lines taken from lines[] (release: they can be reused) */
+    atomic_ulong	ovf_rd_seq;		/* Lines taken from ovf_lines[] */
+    unsigned int	rd_idx;			/* Actual read index */
+    unsigned int	ovf_rd_idx;		/* Overflow read index */
+    atomic_ulong	sig_rd_seq;		/* Lines taken from sig_lines[] */
+    unsigned int	sig_rd_idx;		/* Signal lane read index */
 } logger_write_queue_t;
 
+/**
+ * Context of a worker thread, for the user space schedulers (fibers,
+ * coroutines, ...): its queue.  Got once by the worker, it is passed to
+ * logger_printf_ctx() to avoid the TLS lookup.  The scheduler sets the
+ * task running on it at each switch.  Only the worker can use it.
+ */
+typedef logger_write_queue_t logger_ctx_t;
+
+/* Queues merged by their own thread in an ordered queue, itself merged by the reader (LOGGER_OPT_GROUPS) */
+typedef struct {
+    logger_write_queue_t	queue;			/* Lines of the group, in order (queue_idx < 0) */
+    int				first;			/* Index of its 1st queue in logger.queues */
+    bool			running;		/* Set to false to stop its thread (once empty) */
+    pthread_t			thread;			/* Thread merging the group */
+    _LOGGER_CACHE_ALIGNED
+    atomic_int			waiting;		/* True (1) if its thread is sleeping (alone on its cache line) */
+} logger_group_t;
+
 typedef struct {
     const char *level[LOGGER_LEVEL_COUNT];		/* Colors definition for the log levels */
     const char *reset;					/* Reset the color to default */
@@ -107,6 +298,22 @@ typedef struct {
     const char *thread_name;				/* Thread name (or id) color */
 } logger_line_colors_t;
 
+/* Entry of the index of the output file (LOGGER_OPT_INDEX), in the host byte order */
+typedef struct {
+    uint64_t			ms;			/* Time stamp of the line (ms since the epoch) */
+    uint64_t			offset;			/* Where the line starts in the file (gzipped: its member) */
+} logger_index_entry_t;
+
+/* What all the processes must see (LOGGER_OPT_SHARED) */
+typedef struct {
+    _LOGGER_CACHE_ALIGNED
+    atomic_int			waiting;		/* Replaces logger.waiting */
+    _LOGGER_CACHE_ALIGNED
+    atomic_int			flushed;		/* Replaces logger.flushed */
+    atomic_int			flushers;		/* Replaces logger.flushers */
+    size_t			size;			/* Size of the whole shared area */
+} logger_shared_t;
+
 typedef struct {
     logger_write_queue_t	**queues;		/* Write queues, 1 per thread */
     int			 	queues_nr;		/* Number of queues allocated */
@@ -115,10 +322,30 @@ typedef struct {
     logger_line_level_t		level_min;		/* Minimum level to be printed/processed */
     bool		 	running;		/* Set to true when the reader thread is running */
     bool		 	empty;			/* Set to true when all the queues are empty */
+    bool			unordered;		/* Drain the queues one by one, not in order (can be changed at runtime) */
+    logger_format_t		format;			/* Output format of the lines (can be changed at runtime) */
+    logger_line_level_t		escalate_level;		/* Min. level of a thread after an error (<= level_min: never) */
+    int				escalate_ms;		/* Duration of the escalation (both can be changed at runtime) */
+    int				escalate_lines;		/* Lines printed thanks to it, at most */
     logger_opts_t	 	opts;			/* Default logger options. Some can be fine tuned by write queue */
-    atomic_int		 	reload;			/* True (1) when new queue(s) are added */
-    atomic_int		 	waiting;		/* True (1) if the reader-thread is sleeping ... */
+    atomic_int		 	reload;			/* Changed when queue(s) are added / freed (each merger reloads) */
+    atomic_int			released;		/* Number of queues waiting to be freed by the reader */
+    _LOGGER_CACHE_ALIGNED
+    atomic_int		 	waiting;		/* True (1) if the reader-thread is sleeping (alone on its cache line) */
+    _LOGGER_CACHE_ALIGNED
+    atomic_int			flushed;		/* Steps done by the reader while flushers wait (futex) */
+    atomic_int			flushers;		/* Number of threads in logger_flush() */
+    atomic_int			name_width;		/* Widest thread name printed so far (to align the lines) */
+    bool			name_width_fixed;	/* Lines prerendered: the names are aligned on the longest possible */
     pthread_t		 	reader_thread;		/* TID of the reader thread */
+    pid_t			reader_tid;		/* Its kernel TID (for setpriority()) */
+    atomic_int			reader_moved;		/* True (1) when the reader has to reallocate its merge state */
+    int				event_fd;		/* eventfd signaled by the writers (LOGGER_OPT_EXTERNAL) */
+    pid_t			reader_pid;		/* Process running the reader thread */
+    logger_shared_t		*shared;		/* Shared memory (LOGGER_OPT_SHARED), queues included */
+    logger_group_t		*groups;		/* Groups of queues (LOGGER_OPT_GROUPS) */
+    int				groups_nr;		/* Number of groups */
+    int				futex_private;		/* FUTEX_PRIVATE_FLAG, unless the queues are shared */
     pthread_mutex_t	 	queues_mx;		/* Needed when extending the **queues array... */
     const logger_line_colors_t	*theme;			/* Color theme to use */
 } logger_t;
@@ -137,6 +364,12 @@ int	logger_assign_write_queue(			/* Assign a queue to the calling thread */
 
 int	logger_free_write_queue(void);			/* Release the write queue for another thread */
 
+int	logger_flush(					/* Wait until the lines logged so far (by all the threads) are written */
+		int timeout_ms);			/* Max time to wait (<0: no limit). -1 & ETIMEDOUT when reached */
+
+int	logger_flush_self(				/* Same, for the lines of the calling thread only */
+		int timeout_ms);			/* Max time to wait (<0: no limit). -1 & ETIMEDOUT when reached */
+
 int	logger_pthread_create(				/* Create a new thread with logger queue assignment */
 		const char *thread_name,		/* Thread name to give */
 		unsigned int max_lines,			/* Lines buffer to allocte for that thread (=0 use default) */
@@ -146,6 +379,32 @@ int	logger_pthread_create(				/* Create a new thread with logger queue assignmen
 		void *(*start_routine)(void *),
 		void *arg);
 
+int	logger_pthread_create_sched(			/* Same, placed/scheduled before its queue is allocated */
+		const char *thread_name,		/* Thread name to give */
+		unsigned int max_lines,			/* Lines buffer to allocte for that thread (=0 use default) */
+		logger_opts_t opts,			/* Options to used for this queue. (=0 use default) */
+		const logger_sched_t *sched,		/* Affinity / scheduling of the thread */
+		pthread_t *thread,			/* See pthread_create(3) for these args */
+		const pthread_attr_t *attr,
+		void *(*start_routine)(void *),
+		void *arg);
+
+int	logger_set_reader_sched(			/* Before logger_init() (used at the start of the reader), or at runtime */
+		const logger_sched_t *sched);		/* Affinity / scheduling of the reader thread */
+
+logger_ctx_t *logger_get_ctx(void);			/* Context of the calling thread (queue assigned if needed). NULL on error */
+
+int	logger_set_task(				/* Set the logical task running on the calling thread */
+		const char *task);			/* Its name (NULL: none). Copied at each print, must stay valid */
+
+int	logger_printf_ctx(				/* Print a message from a worker context */
+		logger_ctx_t *ctx,			/* Context of the calling thread (see logger_get_ctx()) */
+		logger_line_level_t level,		/* Importance level of this print */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line,			/* Line of this msg */
+		const char *format, ...);		/* printf() like format & arguments ... */
+
 int	logger_printf(					/* Print a message */
 		logger_line_level_t level,		/* Importance level of this print */
 		const char *src,			/* Source file of this msg */
@@ -153,8 +412,104 @@ int	logger_printf(					/* Print a message */
 		unsigned int line,			/* Line of this msg */
 		const char *format, ...);		/* printf() like format & arguments ... */
 
+/* LOGGER_OPT_EXTERNAL: the lines are printed by the caller's event loop, instead of a reader thread */
+int	logger_get_fd(void);				/* eventfd to poll (readable when there are lines to print) */
+
+int	logger_process(					/* Merge & print the lines. Returns how many were printed */
+		int budget);				/* Max lines to print (=0 until empty). The fd stays readable if not done */
+
+/* LOGGER_OPT_PROFILE: the call sites printing (or dropping) the most lines, with the bytes printed and
+ * the average time their lines spent in the queues.  Returns the number of sites listed */
+int	logger_dump_profile(
+		int fd,					/* Where to write the report */
+		int top);				/* Number of sites to list (<= 0: all) */
+
+/* The buffer is printed after the message, without being copied by the caller: it is released by the
+ * logger thread once printed. release() is always called once, also when the line is filtered or lost. */
+int	logger_printf_attach(				/* Print a message with a buffer attached by reference */
+		logger_line_level_t level,		/* Importance level of this print */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line,			/* Line of this msg */
+		const logger_attach_t *attach,		/* Buffer to attach (not supported with LOGGER_OPT_SHARED) */
+		const char *format, ...);		/* printf() like format & arguments ... */
+
+/* Low level access to the queue, to let the caller fill the line himself (binary data + render
+ * callback for example).  Nothing else can be printed by the thread between the 2 calls. */
+logger_line_t *logger_reserve_line(			/* Wait for the next free line of the thread's queue */
+		logger_line_level_t level);		/* NULL on error, or with errno = 0 if the level is filtered */
+
+int	logger_publish_line(				/* Time stamp the reserved line & pass it to the reader */
+		logger_line_t *l,			/* Line returned by logger_reserve_line() */
+		logger_line_level_t level,		/* Same importance level as for the reservation */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line);			/* Line of this msg */
+
+/* Line built piece by piece, directly in the queue (no intermediate buffer).  NULL when the level is
+ * filtered (errno = 0) or on error: the other calls do nothing with it.  Same as above, nothing else
+ * can be printed by the thread before the commit. */
+logger_line_t *logger_line_begin(			/* Wait for the next free line of the thread's queue */
+		logger_line_level_t level);		/* Importance level of the line */
+
+int	logger_line_append(				/* Append a string. -1 (ENOSPC) if it was truncated */
+		logger_line_t *l,			/* Line returned by logger_line_begin() */
+		const char *str);
+
+int	logger_line_appendf(				/* Append a printf() like formatted string. Same */
+		logger_line_t *l,			/* Line returned by logger_line_begin() */
+		const char *format, ...);
+
+int	logger_line_commit(				/* Time stamp the line & pass it to the reader (see LOG_LINE_COMMIT()) */
+		logger_line_t *l,			/* Line returned by logger_line_begin() */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line);			/* Line of this msg */
+
+/* Block of lines printed together: reserved at once, time stamped & passed to the reader at once, and
+ * printed one after the other.  Same as above, nothing else can be printed by the thread meanwhile. */
+int	logger_reserve_block(				/* Wait for count free lines in the thread's queue */
+		logger_line_level_t level,		/* Least important level of the block (LOGGER_OPT_PRIORESERVE) */
+		int count);				/* Lines to reserve (at most the size of the queue) */
+
+int	logger_block_printf(				/* Fill the next reserved line (see LOG_BLOCK()) */
+		logger_line_level_t level,		/* Importance level of this line */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line,			/* Line of this msg */
+		const char *format, ...);		/* printf() like format & arguments ... */
+
+int	logger_publish_block(void);			/* Time stamp the lines filled & pass them to the reader */
+
+/* Async-signal-safe print, from a signal handler.  The line goes in a small lane of the thread's
+ * queue, merged in order with the others.  Never waits: -1 (EAGAIN) if the lane is full, or if the
+ * thread has no queue yet (ENOENT).  Only %%, %c, %s, %d, %i, %u, %x, %X & %p are understood, with
+ * the h, l, ll & z modifiers (the flags, width & precision are ignored). */
+int	logger_signal_printf(
+		logger_line_level_t level,		/* Importance level of this print */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line,			/* Line of this msg */
+		const char *format, ...);		/* Restricted printf() like format & arguments ... */
+
+int	logger_log_fields(				/* Print a message with structured fields */
+		logger_line_level_t level,		/* Importance level of this print */
+		const char *src,			/* Source file of this msg */
+		const char *func,			/* Function of this msg */
+		unsigned int line,			/* Line of this msg */
+		const char *msg,			/* Message (not a format) */
+		const logger_field_t *fields);		/* Fields, ended by a LOGGER_FIELD_END one */
+
 extern logger_t logger; /* Global logger context */
 
+/* Switch of the logical task (hook for the scheduler): no call, no TLS */
+static inline void logger_ctx_set_task(logger_ctx_t *ctx, const char *task)
+{
+    if (ctx) {
+        ctx->task = task;
+    }
+}
+
 extern const logger_line_colors_t logger_colors_bw;	/* No colors theme (black & white) */
 extern const logger_line_colors_t logger_colors_default;/* Default theme */
 
@@ -201,6 +556,15 @@ extern const logger_line_colors_t logger_colors_default;/* Default theme */
 #if defined(LOGGER_USE_THREAD)
 
 #define LOG_LEVEL(lvl, fmt, ...) logger_printf((lvl), __FILE__, __FUNCTION__, __LINE__, fmt, ## __VA_ARGS__)
+#define LOG_BLOCK(lvl, fmt, ...) logger_block_printf((lvl), __FILE__, __FUNCTION__, __LINE__, fmt, ## __VA_ARGS__)
+#define LOG_LINE_COMMIT(l)	logger_line_commit((l), __FILE__, __FUNCTION__, __LINE__)
+#define LOG_SIGNAL(lvl, fmt, ...) logger_signal_printf((lvl), __FILE__, __FUNCTION__, __LINE__, fmt, ## __VA_ARGS__)
+#define LOG_CTX(ctx, lvl, fmt, ...) logger_printf_ctx((ctx), (lvl), __FILE__, __FUNCTION__, __LINE__, fmt, ## __VA_ARGS__)
+#define LOG_ATTACH(lvl, buf, len, mode, release, arg, fmt, ...) \
+        logger_printf_attach((lvl), __FILE__, __FUNCTION__, __LINE__, \
+                                &(logger_attach_t){ (buf), (len), (mode), (release), (arg) }, fmt, ## __VA_ARGS__)
+#define LOG_FIELDS(lvl, msg, ...) logger_log_fields((lvl), __FILE__, __FUNCTION__, __LINE__, msg, \
+                                        (const logger_field_t []){ __VA_ARGS__, { .type = LOGGER_FIELD_END } })
 
 #if _MIN_LOGGER_LEVEL >= 0
 #define LOG_EMERGENCY(fmt, ...)	logger_printf(LOGGER_LEVEL_EMERG, __FILE__, __FUNCTION__, __LINE__, fmt, ## __VA_ARGS__)
@@ -269,6 +633,21 @@ extern const logger_line_colors_t logger_colors_default;/* Default theme */
 #define LOG_LEVEL(lvl, fmt, ...) ({ \
         (void)(lvl); _LOG_PRINTF(fmt, ## __VA_ARGS__ ); \
 })
+#define LOG_BLOCK		LOG_LEVEL
+#define LOG_SIGNAL(lvl, ...)	({ (void)(lvl); (int)0; }) /* printf() is not async-signal-safe */
+#define LOG_CTX(ctx, lvl, fmt, ...) ({ \
+        (void)(ctx); (void)(lvl); _LOG_PRINTF(fmt, ## __VA_ARGS__ ); \
+})
+#define LOG_FIELDS(lvl, msg, ...) ({ \
+        (void)(lvl); _LOG_PRINTF("%s", msg); \
+})
+#define LOG_ATTACH(lvl, buf, len, mode, release, arg, fmt, ...) ({ \
+        logger_release_t _release = (release); \
+        int _ret = _LOG_PRINTF(fmt, ## __VA_ARGS__); \
+        (void)(lvl); (void)(mode); \
+        if (_release) _release((buf), (len), (arg)); \
+        _ret; \
+})
 #if _MIN_LOGGER_LEVEL >= 0
 #define LOG_EMERGENCY		_LOG_PRINTF
 #else
@@ -329,14 +708,45 @@ extern const logger_line_colors_t logger_colors_default;/* Default theme */
 #define logger_deinit(...)		({ (void)0; })
 #define logger_assign_write_queue(...)	({ (int)0; })
 #define logger_free_write_queue(...)	({ (int)0; })
+#define logger_flush(...)		({ (int)fflush(stdout); })
+#define logger_flush_self(...)		({ (int)fflush(stdout); })
+#define logger_get_fd(...)		({ errno = EINVAL; (int)-1; })
+#define logger_process(...)		({ (int)0; })
+#define logger_dump_profile(...)	({ (int)0; })
+#define logger_reserve_line(...)	({ errno = 0; (logger_line_t *)NULL; })
+#define logger_publish_line(...)	({ (int)0; })
+#define logger_reserve_block(...)	({ (int)0; })
+#define logger_line_begin(...)		({ errno = 0; (logger_line_t *)NULL; })
+#define logger_line_append(...)		({ (int)0; })
+#define logger_line_appendf(...)	({ (int)0; })
+#define logger_line_commit(...)		({ (int)0; })
+#define LOG_LINE_COMMIT(l)		({ (void)(l); (int)0; })
+#define logger_publish_block(...)	({ (int)0; })
+#define logger_signal_printf(...)	({ (int)0; })
 
 #define logger_pthread_create(a, b, c, d, e, f, g) ({ \
             (void)(a); (void)(b); (void)(c); pthread_create(d, e, f, g); \
 })
+#define logger_pthread_create_sched(a, b, c, s, d, e, f, g) ({ \
+            (void)(a); (void)(b); (void)(c); (void)(s); pthread_create(d, e, f, g); \
+})
+#define logger_set_reader_sched(...)	({ (int)0; })
+#define logger_get_ctx(...)		({ (logger_ctx_t *)NULL; })
+#define logger_set_task(...)		({ (int)0; })
 
 #else // default => Strip all
 
 #define LOG_LEVEL(lvl, ...)	({ (void)(lvl); (int)0; })
+#define LOG_BLOCK		LOG_LEVEL
+#define LOG_SIGNAL(lvl, ...)	({ (void)(lvl); (int)0; })
+#define LOG_CTX(ctx, lvl, ...)	({ (void)(ctx); (void)(lvl); (int)0; })
+#define LOG_FIELDS(lvl, ...)	({ (void)(lvl); (int)0; })
+#define LOG_ATTACH(lvl, buf, len, mode, release, arg, ...) ({ \
+        logger_release_t _release = (release); \
+        (void)(lvl); (void)(mode); \
+        if (_release) _release((buf), (len), (arg)); \
+        (int)0; \
+})
 #define LOG_EMERGENCY(...)	({ (int)0; })
 #define LOG_ALERT(...)		({ (int)0; })
 #define LOG_CRITICAL(...)	({ (int)0; })
@@ -353,10 +763,31 @@ extern const logger_line_colors_t logger_colors_default;/* Default theme */
 #define logger_deinit(...)		({ (void)0; })
 #define logger_assign_write_queue(...)	({ (int)0; })
 #define logger_free_write_queue(...)	({ (int)0; })
+#define logger_flush(...)		({ (int)0; })
+#define logger_flush_self(...)		({ (int)0; })
+#define logger_get_fd(...)		({ errno = EINVAL; (int)-1; })
+#define logger_process(...)		({ (int)0; })
+#define logger_dump_profile(...)	({ (int)0; })
+#define logger_reserve_line(...)	({ errno = 0; (logger_line_t *)NULL; })
+#define logger_publish_line(...)	({ (int)0; })
+#define logger_reserve_block(...)	({ (int)0; })
+#define logger_line_begin(...)		({ errno = 0; (logger_line_t *)NULL; })
+#define logger_line_append(...)		({ (int)0; })
+#define logger_line_appendf(...)	({ (int)0; })
+#define logger_line_commit(...)		({ (int)0; })
+#define LOG_LINE_COMMIT(l)		({ (void)(l); (int)0; })
+#define logger_publish_block(...)	({ (int)0; })
+#define logger_signal_printf(...)	({ (int)0; })
 
 #define logger_pthread_create(a, b, c, d, e, f, g) ({ \
             (void)(a); (void)(b); (void)(c); pthread_create(d, e, f, g); \
 })
+#define logger_pthread_create_sched(a, b, c, s, d, e, f, g) ({ \
+            (void)(a); (void)(b); (void)(c); (void)(s); pthread_create(d, e, f, g); \
+})
+#define logger_set_reader_sched(...)	({ (int)0; })
+#define logger_get_ctx(...)		({ (logger_ctx_t *)NULL; })
+#define logger_set_task(...)		({ (int)0; })
 #endif // defined(LOGGER_USE_PRINTF)
 #endif // defined(LOGGER_USE_THREAD)
 
@@ -0,0 +1,325 @@
+#pragma once
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2022 David De Grave <david@ledav.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _LOGGER_HPP
+#define _LOGGER_HPP
+
+/**
+ * C++20 front-end:
+ *
+ *   logging::info("x={} y={}", x, y);
+ *
+ * The format is checked at compile time against the arguments.  The
+ * arguments are just copied (binary) in the line of the queue, with a
+ * render function made for their types.  This one is called by the logger
+ * thread to make the text.  So there is no printf() like parsing in the
+ * writer thread at all.
+ *
+ * Supported types: integers, enums, bool, char, floating points, pointers,
+ * C strings, std::string_view and std::string (copied, truncated if the
+ * line is full).  Use "{{" and "}}" to print the braces.
+ */
+
+#include <source_location>
+#include <string_view>
+#include <type_traits>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <string>
+
+#include "logger.h"
+
+namespace logging {
+namespace detail {
+
+consteval bool check_format(std::string_view fmt, std::size_t args_nr)
+{
+    std::size_t count = 0;
+
+    for (std::size_t i = 0; i < fmt.size(); i++) {
+        if (fmt[i] == '{') {
+            if (i + 1 < fmt.size() && fmt[i+1] == '{') { i++; continue; }
+            if (i + 1 < fmt.size() && fmt[i+1] == '}') { i++; count++; continue; }
+            return false; // Only "{}" is supported
+        }
+        if (fmt[i] == '}') {
+            if (i + 1 < fmt.size() && fmt[i+1] == '}') { i++; continue; }
+            return false;
+        }
+    }
+    return count == args_nr;
+}
+
+template<typename... Args>
+struct format_string {
+    const char *str;
+    std::source_location loc;
+
+    template<std::size_t N>
+    consteval format_string(const char (&s)[N], std::source_location l = std::source_location::current())
+        : str(s), loc(l)
+    {
+        if (!check_format(std::string_view(s, N - 1), sizeof...(Args))) {
+            /* Not a constant expression => compile error pointing here */
+            throw "logging: the format does not match the arguments (or is not only made of {})";
+        }
+    }
+};
+
+/* Output of the render function */
+struct text {
+    char       *buf;
+    std::size_t size;
+    std::size_t len = 0;
+
+    void put(const char *s, std::size_t n) {
+        if (len + n >= size) {
+            n = len < size - 1 ? size - 1 - len : 0;
+        }
+        memcpy(buf + len, s, n);
+        len += n;
+    }
+    template<typename... V>
+    void printf(const char *fmt, V... v) {
+        if (len < size - 1) {
+            int r = snprintf(buf + len, size - len, fmt, v...);
+            len += r < 0 ? 0 : (std::size_t)r < size - len ? r : size - 1 - len;
+        }
+    }
+    /* Literal part of the format up to the next "{}" (returned) or the end */
+    const char *literal(const char *fmt) {
+        while (*fmt) {
+            if (fmt[0] == '{' && fmt[1] == '}') {
+                break;
+            }
+            if ((fmt[0] == '{' && fmt[1] == '{') || (fmt[0] == '}' && fmt[1] == '}')) {
+                fmt++;
+            }
+            put(fmt++, 1);
+        }
+        return fmt;
+    }
+};
+
+/* Input of the encoder (the line in the queue) */
+struct data {
+    char       *buf;
+    std::size_t size;
+    std::size_t len = 0;
+    std::size_t reserved = 0; /* Fixed size of the arguments still to encode */
+
+    template<typename T>
+    void put(const T &v) {
+        if (sizeof(T) > size - len) {
+            return; // Can't happen with the reservation: never write past the line
+        }
+        memcpy(buf + len, &v, sizeof(T));
+        len += sizeof(T);
+    }
+    /* Truncated to keep the room of the arguments after it */
+    void put_str(const char *s, std::size_t n) {
+        std::size_t need = sizeof(unsigned int) + reserved;
+        std::size_t room = size - len > need ? size - len - need : 0;
+        unsigned int l = n < room ? n : room;
+        put(l);
+        memcpy(buf + len, s, l);
+        len += l;
+    }
+};
+
+template<typename T>
+inline T get(const char *&p)
+{
+    T v;
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
+}
+
+template<typename T, typename = void>
+struct codec; // No specialisation => unsupported type
+
+template<typename T>
+struct codec<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>>> {
+    static constexpr std::size_t size = sizeof(T);
+    static void encode(data &d, T v) { d.put(v); }
+    static void decode(text &t, const char *&p) {
+        if constexpr (std::is_signed_v<T>) {
+            t.printf("%lld", (long long)get<T>(p));
+        } else {
+            t.printf("%llu", (unsigned long long)get<T>(p));
+        }
+    }
+};
+
+template<typename T>
+struct codec<T, std::enable_if_t<std::is_enum_v<T>>> {
+    using U = std::underlying_type_t<T>;
+    static constexpr std::size_t size = sizeof(U);
+    static void encode(data &d, T v) { codec<U>::encode(d, (U)v); }
+    static void decode(text &t, const char *&p) { codec<U>::decode(t, p); }
+};
+
+template<>
+struct codec<bool> {
+    static constexpr std::size_t size = 1;
+    static void encode(data &d, bool v) { d.put(v); }
+    static void decode(text &t, const char *&p) { get<bool>(p) ? t.put("true", 4) : t.put("false", 5); }
+};
+
+template<>
+struct codec<char> {
+    static constexpr std::size_t size = 1;
+    static void encode(data &d, char v) { d.put(v); }
+    static void decode(text &t, const char *&p) { char c = get<char>(p); t.put(&c, 1); }
+};
+
+template<typename T>
+struct codec<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static constexpr std::size_t size = sizeof(double);
+    static void encode(data &d, T v) { d.put((double)v); }
+    static void decode(text &t, const char *&p) { t.printf("%g", get<double>(p)); }
+};
+
+struct string_codec {
+    static constexpr std::size_t size = sizeof(unsigned int);
+    static void decode(text &t, const char *&p) {
+        unsigned int l = get<unsigned int>(p);
+        t.put(p, l);
+        p += l;
+    }
+};
+
+template<>
+struct codec<const char *> : string_codec {
+    static void encode(data &d, const char *v) {
+        v ? d.put_str(v, strlen(v)) : d.put_str("(null)", 6);
+    }
+};
+
+template<>
+struct codec<char *> : codec<const char *> {};
+
+template<>
+struct codec<std::string_view> : string_codec {
+    static void encode(data &d, std::string_view v) { d.put_str(v.data(), v.size()); }
+};
+
+template<>
+struct codec<std::string> : string_codec {
+    static void encode(data &d, const std::string &v) { d.put_str(v.data(), v.size()); }
+};
+
+template<typename T>
+struct codec<T *, std::enable_if_t<!std::is_same_v<std::remove_cv_t<T>, char>>> {
+    static constexpr std::size_t size = sizeof(const void *);
+    static void encode(data &d, const void *v) { d.put(v); }
+    static void decode(text &t, const char *&p) { t.printf("%p", get<const void *>(p)); }
+};
+
+/* char arrays (literals) are C strings */
+template<typename T>
+using arg_t = std::conditional_t<std::is_array_v<std::remove_reference_t<T>>,
+                                 const char *, std::remove_cv_t<std::remove_reference_t<T>>>;
+
+template<typename... Args>
+int render(char *buf, size_t size, const char *p)
+{
+    text t { buf, size };
+    const char *fmt = get<const char *>(p);
+
+    ((fmt = t.literal(fmt), codec<Args>::decode(t, p), fmt += 2), ...);
+    t.literal(fmt);
+    t.buf[t.len] = 0;
+    return t.len;
+}
+
+template<typename... Args>
+void encode(char *buf, size_t size, const char *fmt, const Args &... args)
+{
+    static_assert(sizeof(const char *) + (codec<Args>::size + ... + 0) <= LOGGER_LINE_SZ,
+                  "logging: too many arguments for LOGGER_LINE_SZ");
+    data d { buf, size, 0, (codec<Args>::size + ... + 0) };
+
+    d.put(fmt);
+    ((d.reserved -= codec<Args>::size, codec<Args>::encode(d, args)), ...);
+}
+
+template<logger_line_level_t Level, typename... Args>
+inline int log(const format_string<Args...> &fmt, const Args &... args)
+{
+    if constexpr ((int)Level > _MIN_LOGGER_LEVEL) {
+        return 0; // Stripped at compile time, like the LOG_xxx() macros
+    } else {
+#if defined(LOGGER_USE_THREAD)
+        logger_line_t *l = logger_reserve_line(Level);
+
+        if (!l) {
+            return errno ? -1 : 0;
+        }
+        encode(l->str, sizeof(l->str), fmt.str, args...);
+        l->render = render<Args...>;
+
+        return logger_publish_line(l, Level, fmt.loc.file_name(), fmt.loc.function_name(), fmt.loc.line());
+#elif defined(LOGGER_USE_PRINTF)
+        char bin[LOGGER_LINE_SZ], str[LOGGER_LINE_SZ];
+
+        encode(bin, sizeof(bin), fmt.str, args...);
+        render<Args...>(str, sizeof(str), bin);
+
+        return printf("%s: %s:%4d> %s\n", fmt.loc.file_name(), fmt.loc.function_name(), (int)fmt.loc.line(), str);
+#else
+        return 0;
+#endif
+    }
+}
+
+} // namespace detail
+
+template<typename... Args>
+using format_string = detail::format_string<std::type_identity_t<detail::arg_t<Args>>...>;
+
+#define _LOGGER_CXX_LEVEL(name, level) \
+    template<typename... Args> \
+    inline int name(format_string<Args...> fmt, Args &&... args) { \
+        return detail::log<level, detail::arg_t<Args>...>(fmt, args...); \
+    }
+
+_LOGGER_CXX_LEVEL(emergency, LOGGER_LEVEL_EMERG)
+_LOGGER_CXX_LEVEL(alert,     LOGGER_LEVEL_ALERT)
+_LOGGER_CXX_LEVEL(critical,  LOGGER_LEVEL_CRITICAL)
+_LOGGER_CXX_LEVEL(error,     LOGGER_LEVEL_ERROR)
+_LOGGER_CXX_LEVEL(warning,   LOGGER_LEVEL_WARNING)
+_LOGGER_CXX_LEVEL(notice,    LOGGER_LEVEL_NOTICE)
+_LOGGER_CXX_LEVEL(info,      LOGGER_LEVEL_INFO)
+_LOGGER_CXX_LEVEL(debug,     LOGGER_LEVEL_DEBUG)
+_LOGGER_CXX_LEVEL(okay,      LOGGER_LEVEL_OKAY)
+_LOGGER_CXX_LEVEL(trace,     LOGGER_LEVEL_TRACE)
+_LOGGER_CXX_LEVEL(oops,      LOGGER_LEVEL_OOPS)
+
+#undef _LOGGER_CXX_LEVEL
+
+} // namespace logging
+
+#endif // _LOGGER_HPP
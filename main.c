@@ -58,13 +58,14 @@ typedef struct  {
     const _thread_params *params;  // Input parameters
     const unsigned int   *work;    // Input workset to print
     unsigned int         *printed; // Output printed lines (thread)
+    unsigned long        *spent;   // Output time spent in logger_printf() (ns)
 } _thread_args;
 
 /* Test thread */
 static void *thread_func_write(const _thread_args *tha)
 {
     char th[LOGGER_MAX_THREAD_NAME_SZ];
-    unsigned long elapsed = 0;
+    unsigned long elapsed = 0, spent = 0;
     unsigned int  count = 0;
 
     pthread_getname_np(pthread_self(), th, sizeof(th));
@@ -106,12 +107,14 @@ static void *thread_func_write(const _thread_args *tha)
 
         clock_gettime(CLOCK_MONOTONIC, &after);
         elapsed = elapsed_ns(before, after);
+        spent += elapsed;
 
         if ( r < 0 ) {
             dbg_printf("<%s> Message #%d **LOST** (%m)\n", th, seq);
         }
         else count++;
     }
+    *tha->spent += spent;
     *tha->printed = count;
     return NULL;
 }
@@ -181,6 +184,7 @@ int main(int argc, char **argv)
     _thread_args  tha[thp.thread_max]; // THread Args
     unsigned int  twk[thp.thread_max]; // Thread WorK (lines asked to log)
     unsigned int  tpr[thp.thread_max]; // Thread PRinted (lines really logged)
+    unsigned long tsp[thp.thread_max]; // Thread SPent in logger_printf() (ns)
     unsigned long dispatched_lines = 0;
     unsigned long printed_lines = 0;
 
@@ -189,7 +193,8 @@ int main(int argc, char **argv)
         tha[i].params = &thp;
         tha[i].work = &twk[i];
         tha[i].printed = &tpr[i];
-        tid[i] = tpr[i] = twk[i] = 0;
+        tha[i].spent = &tsp[i];
+        tid[i] = tpr[i] = twk[i] = tsp[i] = 0;
     }
 
     logger_init(thp.thread_max * 5, 50, LOGGER_LEVEL_DEFAULT, LOGGER_OPT_NONE);
@@ -197,6 +202,7 @@ int main(int argc, char **argv)
 
     int running;
 
+    clock_gettime(CLOCK_MONOTONIC, &before);
     do {
         running = thp.thread_max;
 
@@ -237,9 +243,19 @@ int main(int argc, char **argv)
     }
     while ( running );
 
+    clock_gettime(CLOCK_MONOTONIC, &after);
     logger_deinit();
 
+    unsigned long spent = 0, wall = elapsed_ns(before, after);
+
+    for (int i=0 ; i < thp.thread_max ; i++ ) {
+        spent += tsp[i];
+    }
     dbg_printf("%lu total lines dispatched and %lu lines printed (%lu lost) ...\n",
                 dispatched_lines, printed_lines, dispatched_lines - printed_lines);
+    /* Parsed by bench.sh */
+    dbg_printf("bench: threads=%d lines=%lu wall=%lu ms lines/s=%lu printf=%lu ns\n", thp.thread_max, dispatched_lines,
+                wall / MTON(1), wall ? (unsigned long)(dispatched_lines * 1e9 / wall) : 0,
+                dispatched_lines ? spent / dispatched_lines : 0);
     return 0;
 }
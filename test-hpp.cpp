@@ -0,0 +1,106 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2022 David De Grave <david@ledav.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks of the C++ front-end encoding (build and run with "make test", under
+ * ASan): the arguments are encoded in a line of the size of the queue ones
+ * and rendered back, like the logger thread does.  Then the same through
+ * the queues and the logger thread, with stdout in a temporary file.
+ */
+
+#include <unistd.h>
+#include <string>
+
+#include "logger.hpp"
+
+static int failed = 0;
+
+template<typename... Args>
+static void check(const char *expected, const char *fmt, const Args &... args)
+{
+    /* Exactly the size of a line: ASan sees any write past it */
+    char *bin = new char[LOGGER_LINE_SZ];
+    char str[LOGGER_LINE_SZ];
+
+    logging::detail::encode<logging::detail::arg_t<Args>...>(bin, LOGGER_LINE_SZ, fmt, args...);
+    logging::detail::render<logging::detail::arg_t<Args>...>(str, sizeof(str), bin);
+    delete[] bin;
+
+    if (strcmp(str, expected)) {
+        fprintf(stderr, "FAILED: \"%s\" gave \"%.60s...\" (%zu), expected \"%.60s...\" (%zu)\n",
+                fmt, str, strlen(str), expected, strlen(expected));
+        failed++;
+    }
+}
+
+#if defined(LOGGER_USE_THREAD)
+/* Prints through a queue: the message printed by the logger thread (after the name) has to be expected */
+static void check_printed(const std::string &expected, const std::string &big)
+{
+    char path[] = "/tmp/test-hpp-XXXXXX";
+    int fd = mkstemp(path), saved = dup(1);
+    static char output[64 * 1024];
+
+    unlink(path);
+    dup2(fd, 1);
+    close(fd);
+    logger_init(2, 16, LOGGER_LEVEL_DEFAULT, LOGGER_OPT_NONE);
+    int r = logging::info("s={} i={}", big, 42);
+    logger_deinit();
+
+    ssize_t n = pread(1, output, sizeof(output) - 1, 0);
+    output[n < 0 ? 0 : n] = 0;
+    dup2(saved, 1);
+    close(saved);
+
+    const char *msg = strstr(output, "> ");
+    std::string printed = msg ? std::string(msg + 2, strcspn(msg + 2, "\n")) : "";
+
+    if (r < 0 || printed != expected) {
+        fprintf(stderr, "FAILED: printed \"%.60s...\" (%zu, %d), expected \"%.60s...\" (%zu)\n",
+                printed.c_str(), printed.size(), r, expected.c_str(), expected.size());
+        failed++;
+    }
+}
+#endif
+
+int main(void)
+{
+    std::string big(2 * LOGGER_LINE_SZ, 'x');
+    /* Room of a string followed by an int: the line less the format, the length and the int */
+    std::size_t room = LOGGER_LINE_SZ - sizeof(const char *) - sizeof(unsigned int) - sizeof(int);
+
+    check("a=1 b=str c=-2", "a={} b={} c={}", 1, "str", -2L);
+    check(("s=" + big.substr(0, room) + " i=42").c_str(), "s={} i={}", big, 42);
+    check(("s=" + big.substr(0, room) + " i=42").c_str(), "s={} i={}", big.c_str(), 42);
+    check(("s=" + big.substr(0, room - sizeof(unsigned int)) + " t= i=7").c_str(),
+          "s={} t={} i={}", std::string_view(big), big, 7);
+    check(("s=" + big.substr(0, room - sizeof(double)) + " i=3 d=0.5").c_str(), "s={} i={} d={}", big, 3, 0.5);
+#if defined(LOGGER_USE_THREAD)
+    check_printed("s=" + big.substr(0, room) + " i=42", big);
+    check_printed("s=short i=42", "short");
+#endif
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}
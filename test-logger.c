@@ -0,0 +1,210 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2022 David De Grave <david@ledav.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks of the logger (build and run with "make test", under ASan).  Each
+ * check runs a logger with stdout in a temporary file, and looks at what
+ * was printed once logger_deinit() returned.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "logger.h"
+
+static int failed = 0;
+static char output[16 * 1024 * 1024];
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED: %s:%d: %s: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failed++; \
+    } \
+} while (0)
+
+/* stdout in a temporary file until _output_end() (what was printed, in output[]) */
+static int _output_begin(void)
+{
+    char path[] = "/tmp/test-logger-XXXXXX";
+    int fd = mkstemp(path), saved = dup(1);
+
+    unlink(path);
+    dup2(fd, 1);
+    close(fd);
+    return saved;
+}
+
+static const char *_output_end(int saved)
+{
+    ssize_t n = pread(1, output, sizeof(output) - 1, 0);
+
+    output[n < 0 ? 0 : n] = 0;
+    dup2(saved, 1);
+    close(saved);
+    return output;
+}
+
+/* Times "needle" is in the output */
+static int _count(const char *needle)
+{
+    int n = 0;
+
+    for (const char *p = output; (p = strstr(p, needle)); p++) {
+        n++;
+    }
+    return n;
+}
+
+/* A block bigger than the queue: in the overflow lines, or refused */
+static void test_big_block(logger_opts_t opts)
+{
+    int saved = _output_begin();
+
+    logger_init(2, 8, LOGGER_LEVEL_DEFAULT, opts);
+    int r = logger_reserve_block(LOGGER_LEVEL_INFO, 20), err = errno;
+    if (!r) {
+        for (int i=0; i<20; i++) {
+            LOG_BLOCK(LOGGER_LEVEL_INFO, "block line %02d.", i);
+        }
+        logger_publish_block();
+    }
+    logger_deinit();
+    _output_end(saved);
+
+    if (opts & LOGGER_OPT_OVERFLOW) {
+        CHECK(!r, "reserve: %s", strerror(err));
+        const char *prev = output;
+        for (int i=0; i<20; i++) {
+            char line[32];
+            snprintf(line, sizeof(line), "block line %02d.", i);
+            const char *at = strstr(output, line);
+            CHECK(_count(line) == 1 && at >= prev, "\"%s\" printed %d time(s)", line, _count(line));
+            prev = at ? at : prev;
+        }
+    } else {
+        CHECK(r < 0 && err == EINVAL, "reserve: %d (%s)", r, strerror(err));
+        CHECK(!_count("block line"), "lines printed");
+    }
+}
+
+static void *_churn_thread(void *arg)
+{
+    return (void *)(long)LOG_INFO("churn thread %03ld.", (long)arg);
+}
+
+/* Threads exiting without freeing their queue: taken back, never ENOBUFS */
+static void test_thread_churn(void)
+{
+    int saved = _output_begin(), errors = 0;
+
+    logger_init(4, 16, LOGGER_LEVEL_DEFAULT, LOGGER_OPT_NONE);
+    for (long i=0; i<200; i++) {
+        pthread_t thread;
+        void *ret;
+
+        pthread_create(&thread, NULL, _churn_thread, (void *)i);
+        pthread_join(thread, &ret);
+        errors += (long)ret < 0;
+    }
+    logger_deinit();
+    _output_end(saved);
+
+    CHECK(!errors, "%d prints failed", errors);
+    CHECK(_count("churn thread") == 200, "%d lines printed", _count("churn thread"));
+}
+
+/* Column of the end of the name ("> ") of each line, -1 if they differ */
+static int _name_column(void)
+{
+    int column = 0;
+
+    for (const char *l = output; *l; l = strchr(l, '\n') + 1) {
+        const char *end = strstr(l, "> ");
+        int c = end ? end - l : -1;
+
+        if (column && c != column) {
+            return -1;
+        }
+        column = c;
+    }
+    return column;
+}
+
+/* Prerendered lines: the same width with and without a task */
+static void test_name_width(const char *task)
+{
+    int saved = _output_begin();
+
+    logger_init(2, 16, LOGGER_LEVEL_DEFAULT, LOGGER_OPT_NONE);
+    logger_assign_write_queue(0, LOGGER_OPT_PRERENDER);
+    LOG_INFO("before the task.");
+    logger_set_task(task);
+    LOG_INFO("in the task.");
+    logger_set_task(NULL);
+    LOG_INFO("after the task.");
+    logger_deinit();
+    _output_end(saved);
+
+    CHECK(_count("the task.") == 3, "%d lines printed", _count("the task."));
+    CHECK(_name_column() > 0, "names not aligned:\n%s", output);
+}
+
+/* The signal lane: only with LOGGER_OPT_SIGNAL */
+static void test_signal_lane(logger_opts_t opts)
+{
+    int saved = _output_begin();
+
+    logger_init(2, 16, LOGGER_LEVEL_DEFAULT, opts);
+    LOG_INFO("before the signal.");
+    int r = LOG_SIGNAL(LOGGER_LEVEL_INFO, "from a handler %d.", 42), err = errno;
+    logger_deinit();
+    _output_end(saved);
+
+    if (opts & LOGGER_OPT_SIGNAL) {
+        CHECK(!r, "signal print: %s", strerror(err));
+        CHECK(_count("from a handler 42.") == 1, "line printed %d time(s)", _count("from a handler 42."));
+    } else {
+        CHECK(r < 0 && err == ENOTSUP, "signal print: %d (%s)", r, strerror(err));
+        CHECK(!_count("from a handler"), "line printed");
+    }
+}
+
+int main(void)
+{
+    test_big_block(LOGGER_OPT_NONE);
+    test_big_block(LOGGER_OPT_OVERFLOW);
+    test_thread_churn();
+    test_name_width(NULL);
+    test_name_width("a-task-name-of-16");
+    test_signal_lane(LOGGER_OPT_NONE);
+    test_signal_lane(LOGGER_OPT_SIGNAL);
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}